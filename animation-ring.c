@@ -0,0 +1,32 @@
+#include <stdint.h>
+#include "animation-ring.h"
+
+// Slots used once not every frame fits: one on screen, one being scaled,
+// and one the compositor may not have let go of yet
+#define ANIMATION_RING_SLOTS 3
+
+void animation_ring_init(struct animation_ring *ring, size_t num_frames,
+		size_t max_slots) {
+	ring->num_frames = num_frames;
+	if (num_frames <= max_slots) {
+		ring->num_slots = num_frames;
+	} else if (max_slots >= ANIMATION_RING_SLOTS) {
+		// Every frame is scaled again on each loop, so more slots than
+		// this would only hold frames that are overwritten before use
+		ring->num_slots = ANIMATION_RING_SLOTS;
+	} else {
+		ring->num_slots = 2;
+	}
+	ring->shown = SIZE_MAX;
+}
+
+size_t animation_ring_get_slot(const struct animation_ring *ring,
+		size_t frame) {
+	if (ring->num_slots >= ring->num_frames) {
+		return frame;
+	}
+	if (ring->shown == SIZE_MAX) {
+		return 0;
+	}
+	return (ring->shown + 1) % ring->num_slots;
+}
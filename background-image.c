@@ -1,7 +1,31 @@
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
 #include "background-image.h"
 #include "cairo.h"
 #include "log.h"
+#include "pixel-convert.h"
+#include "thread-pool.h"
+
+// Rows per band for render_background_image_banded. This is fixed rather
+// than derived from the thread count so that the output does not depend on it.
+#define RENDER_BAND_HEIGHT 128
+// Longest animation decoded; anything beyond is cut off
+#define ANIMATION_MAX_FRAMES 1024
+// Most memory held by decoded frames, including the repeated run kept while
+// looking for the loop; anything beyond is cut off as well
+#define ANIMATION_MAX_SIZE (256 * 1024 * 1024)
+// Browsers show frames with shorter delays for 100ms, so animations are
+// made with that in mind
+#define ANIMATION_MIN_DELAY 20
+#define ANIMATION_DEFAULT_DELAY 100
+
+static void copy_argb_row(uint8_t *dst, const uint8_t *src, int width) {
+	memcpy(dst, src, (size_t)width * 4);
+}
 
 enum background_mode parse_background_mode(const char *mode) {
 	if (strcmp(mode, "stretch") == 0) {
@@ -21,35 +45,386 @@ enum background_mode parse_background_mode(const char *mode) {
 	return BACKGROUND_MODE_INVALID;
 }
 
-cairo_surface_t *load_background_image(const char *path) {
-	cairo_surface_t *image;
+bool read_background_image_size(const char *path, int *width, int *height) {
+#if HAVE_GDK_PIXBUF
+	return gdk_pixbuf_get_file_info(path, width, height) != NULL;
+#else
+	// Cairo can only tell the size of a PNG by decoding it
+	return false;
+#endif // HAVE_GDK_PIXBUF
+}
+
+bool has_background_image_extension(const char *path) {
+	const char *ext = strrchr(path, '.');
+	const char *name = strrchr(path, '/');
+	if (!ext || (name && ext < name)) {
+		return false;
+	}
+	ext++;
+#if HAVE_GDK_PIXBUF
+	bool found = false;
+	GSList *formats = gdk_pixbuf_get_formats();
+	for (GSList *f = formats; f && !found; f = f->next) {
+		gchar **extensions = gdk_pixbuf_format_get_extensions(f->data);
+		for (gchar **e = extensions; e && *e && !found; ++e) {
+			found = strcasecmp(*e, ext) == 0;
+		}
+		g_strfreev(extensions);
+	}
+	g_slist_free(formats);
+	return found;
+#else
+	return strcasecmp(ext, "png") == 0;
+#endif // HAVE_GDK_PIXBUF
+}
+
+double get_background_image_scale(int image_width, int image_height,
+		enum background_mode mode, int buffer_width, int buffer_height) {
+	double scale_x = (double)buffer_width / image_width;
+	double scale_y = (double)buffer_height / image_height;
+	double scale;
+	switch (mode) {
+	case BACKGROUND_MODE_STRETCH:
+	case BACKGROUND_MODE_FILL:
+		// Keep enough detail for the axis that is shrunk the least
+		scale = scale_x > scale_y ? scale_x : scale_y;
+		break;
+	case BACKGROUND_MODE_FIT:
+		scale = scale_x < scale_y ? scale_x : scale_y;
+		break;
+	default:
+		// Drawn unscaled
+		scale = 1.0;
+		break;
+	}
+	return scale < 1.0 ? scale : 1.0;
+}
+
+#if HAVE_GDK_PIXBUF
+static int scale_dimension(int size, double scale) {
+	// Round up so the decoded image is never smaller than requested
+	int scaled = size * scale;
+	if (scaled < size * scale) {
+		scaled++;
+	}
+	return scaled > 0 ? scaled : 1;
+}
+#endif // HAVE_GDK_PIXBUF
+
+#if HAVE_GDK_PIXBUF
+static bool is_animated_format(const char *path) {
+	GdkPixbufFormat *format = gdk_pixbuf_get_file_info(path, NULL, NULL);
+	if (!format) {
+		return false;
+	}
+	gchar *name = gdk_pixbuf_format_get_name(format);
+	bool animated = strcmp(name, "gif") == 0 || strcmp(name, "webp") == 0 ||
+		strcmp(name, "ani") == 0;
+	g_free(name);
+	return animated;
+}
+
+static bool frames_equal(const struct background_frame *a,
+		const struct background_frame *b) {
+	if (a->delay != b->delay) {
+		return false;
+	}
+	int height = cairo_image_surface_get_height(a->surface);
+	int stride = cairo_image_surface_get_stride(a->surface);
+	// Frames of one animation all have the same size and format
+	return memcmp(cairo_image_surface_get_data(a->surface),
+			cairo_image_surface_get_data(b->surface),
+			(size_t)height * stride) == 0;
+}
+
+static void destroy_frames(struct background_frame *frames, size_t start,
+		size_t end) {
+	for (size_t i = start; i < end; ++i) {
+		cairo_surface_destroy(frames[i].surface);
+	}
+}
+
+/**
+ * Plays the animation on a virtual clock and stores its frames until it
+ * either stops or loops. Nothing tells when an animation loops, so that is
+ * assumed once a run of frames repeats all of the frames before it.
+ */
+static bool decode_animation_frames(struct background_image *image,
+		GdkPixbufAnimation *animation) {
+	struct background_frame *frames =
+		calloc(ANIMATION_MAX_FRAMES, sizeof(struct background_frame));
+	if (!frames) {
+		swaybg_log(LOG_ERROR, "Failed to allocate animation frames");
+		return false;
+	}
+
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+	GTimeVal time = {0};
+	GdkPixbufAnimationIter *iter =
+		gdk_pixbuf_animation_get_iter(animation, &time);
+	size_t num_frames = 0, period = 0, frame_size = 0;
+	bool ok = true;
+	while (num_frames < ANIMATION_MAX_FRAMES &&
+			(num_frames + 1) * frame_size <= ANIMATION_MAX_SIZE) {
+		struct background_frame *frame = &frames[num_frames];
+		frame->surface = gdk_cairo_image_surface_create_from_pixbuf(
+				gdk_pixbuf_animation_iter_get_pixbuf(iter));
+		if (!frame->surface) {
+			swaybg_log(LOG_ERROR, "Failed to convert animation frame.");
+			ok = false;
+			break;
+		}
+		frame->delay = gdk_pixbuf_animation_iter_get_delay_time(iter);
+		if (frame->delay >= 0 && frame->delay < ANIMATION_MIN_DELAY) {
+			frame->delay = ANIMATION_DEFAULT_DELAY;
+		}
+		frame_size = (size_t)cairo_image_surface_get_height(frame->surface) *
+			cairo_image_surface_get_stride(frame->surface);
+		num_frames++;
+		if (frame->delay < 0) {
+			break;
+		}
+
+		size_t n = num_frames - 1;
+		if (period && !frames_equal(frame, &frames[n - period])) {
+			period = 0;
+		}
+		if (!period && n > 0 && frames_equal(frame, &frames[0])) {
+			period = n;
+		}
+		if (period && num_frames == 2 * period) {
+			break;
+		}
+
+		long usec = time.tv_usec + frame->delay * 1000L;
+		time.tv_sec += usec / 1000000;
+		time.tv_usec = usec % 1000000;
+		gdk_pixbuf_animation_iter_advance(iter, &time);
+	}
+	g_object_unref(iter);
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+	if (!ok) {
+		destroy_frames(frames, 0, num_frames);
+		free(frames);
+		return false;
+	}
+	if (period) {
+		destroy_frames(frames, period, num_frames);
+		num_frames = period;
+	} else if (num_frames == ANIMATION_MAX_FRAMES) {
+		swaybg_log(LOG_INFO, "Animation is longer than %d frames, "
+				"cutting it off", ANIMATION_MAX_FRAMES);
+	} else if (frames[num_frames - 1].delay >= 0) {
+		swaybg_log(LOG_INFO, "Animation is larger than %d MiB, "
+				"cutting it off", ANIMATION_MAX_SIZE / (1024 * 1024));
+	}
+	image->frames = realloc(frames,
+			num_frames * sizeof(struct background_frame));
+	if (!image->frames) {
+		image->frames = frames;
+	}
+	image->num_frames = num_frames;
+	return true;
+}
+
+/**
+ * Loads an image in a format that may be animated. Still images that are
+ * to be shrunk are left for the normal loader, which can decode them at the
+ * smaller size; other still images end up as if they were loaded normally.
+ * Errors are left for the normal loader to report.
+ */
+static void load_animation(struct background_image *image, const char *path,
+		double scale) {
+	GdkPixbufAnimation *animation =
+		gdk_pixbuf_animation_new_from_file(path, NULL);
+	if (!animation) {
+		return;
+	}
+	if (scale < 1.0 && gdk_pixbuf_animation_is_static_image(animation)) {
+		g_object_unref(animation);
+		return;
+	}
+	image->pixbuf = gdk_pixbuf_animation_get_static_image(animation);
+	if (image->pixbuf) {
+		g_object_ref(image->pixbuf);
+	}
+	if (image->pixbuf && gdk_pixbuf_get_n_channels(image->pixbuf) >= 3 &&
+			!gdk_pixbuf_animation_is_static_image(animation) &&
+			decode_animation_frames(image, animation)) {
+		// The first frame stands in for the whole animation everywhere else
+		g_object_unref(image->pixbuf);
+		image->pixbuf = NULL;
+		image->surface = cairo_surface_reference(image->frames[0].surface);
+		image->width = cairo_image_surface_get_width(image->surface);
+		image->height = cairo_image_surface_get_height(image->surface);
+		image->opaque = cairo_image_surface_get_format(image->surface) ==
+			CAIRO_FORMAT_RGB24;
+		swaybg_log(LOG_DEBUG, "Decoded %zu frames of %s",
+				image->num_frames, path);
+	}
+	g_object_unref(animation);
+}
+#endif // HAVE_GDK_PIXBUF
+
+struct background_image *load_background_image(const char *path,
+		double scale) {
+	struct background_image *image =
+		calloc(1, sizeof(struct background_image));
+	if (!image) {
+		swaybg_log(LOG_ERROR, "Failed to allocate background image");
+		return NULL;
+	}
+	// Taken before reading, so that a rewrite during decoding can only make
+	// the image look older than it is
+	struct stat st;
+	if (stat(path, &st) == 0) {
+		image->mtime = st.st_mtim;
+		image->file_size = st.st_size;
+	} else {
+		image->file_size = -1;
+	}
 #if HAVE_GDK_PIXBUF
 	GError *err = NULL;
-	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(path, &err);
-	if (!pixbuf) {
+	int width, height;
+	if (is_animated_format(path)) {
+		load_animation(image, path, scale);
+		if (image->surface) {
+			return image;
+		}
+	}
+	if (image->pixbuf) {
+		// A still image in a format that could have been animated
+	} else if (scale < 1.0 &&
+			read_background_image_size(path, &width, &height)) {
+		// Let the loader shrink the image while decoding, which for JPEG
+		// happens in the DCT domain and never holds the full size image
+		image->pixbuf = gdk_pixbuf_new_from_file_at_scale(path,
+				scale_dimension(width, scale), scale_dimension(height, scale),
+				FALSE, &err);
+	} else {
+		image->pixbuf = gdk_pixbuf_new_from_file(path, &err);
+	}
+	if (!image->pixbuf) {
 		swaybg_log(LOG_ERROR, "Failed to load background image (%s).",
 				err->message);
+		g_error_free(err);
+		free(image);
+		return NULL;
+	}
+	if (gdk_pixbuf_get_n_channels(image->pixbuf) < 3) {
+		swaybg_log(LOG_ERROR, "Unsupported background image format.");
+		destroy_background_image(image);
 		return NULL;
 	}
-	image = gdk_cairo_image_surface_create_from_pixbuf(pixbuf);
-	g_object_unref(pixbuf);
+	image->width = gdk_pixbuf_get_width(image->pixbuf);
+	image->height = gdk_pixbuf_get_height(image->pixbuf);
+	image->opaque = !gdk_pixbuf_get_has_alpha(image->pixbuf);
+	return image;
 #else
-	image = cairo_image_surface_create_from_png(path);
-#endif // HAVE_GDK_PIXBUF
-	if (!image) {
+	image->surface = cairo_image_surface_create_from_png(path);
+	if (!image->surface) {
 		swaybg_log(LOG_ERROR, "Failed to read background image.");
+		free(image);
 		return NULL;
 	}
-	if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+	if (cairo_surface_status(image->surface) != CAIRO_STATUS_SUCCESS) {
 		swaybg_log(LOG_ERROR, "Failed to read background image: %s."
-#if !HAVE_GDK_PIXBUF
 				"\nSway was compiled without gdk_pixbuf support, so only"
 				"\nPNG images can be loaded. This is the likely cause."
-#endif // !HAVE_GDK_PIXBUF
-				, cairo_status_to_string(cairo_surface_status(image)));
+				, cairo_status_to_string(cairo_surface_status(image->surface)));
+		destroy_background_image(image);
 		return NULL;
 	}
+	image->width = cairo_image_surface_get_width(image->surface);
+	image->height = cairo_image_surface_get_height(image->surface);
+	image->opaque =
+		cairo_surface_get_content(image->surface) == CAIRO_CONTENT_COLOR;
 	return image;
+#endif // HAVE_GDK_PIXBUF
+}
+
+void destroy_background_image(struct background_image *image) {
+	if (!image) {
+		return;
+	}
+	if (image->surface) {
+		cairo_surface_destroy(image->surface);
+	}
+	for (size_t i = 0; i < image->num_frames; ++i) {
+		cairo_surface_destroy(image->frames[i].surface);
+	}
+	free(image->frames);
+#if HAVE_GDK_PIXBUF
+	if (image->pixbuf) {
+		g_object_unref(image->pixbuf);
+	}
+#endif
+	free(image);
+}
+
+cairo_surface_t *background_image_get_surface(struct background_image *image) {
+#if HAVE_GDK_PIXBUF
+	if (!image->surface) {
+		image->surface = gdk_cairo_image_surface_create_from_pixbuf(
+				image->pixbuf);
+		if (!image->surface) {
+			swaybg_log(LOG_ERROR, "Failed to convert background image.");
+			return NULL;
+		}
+		// Everything else can be served from the surface
+		g_object_unref(image->pixbuf);
+		image->pixbuf = NULL;
+	}
+#endif
+	return image->surface;
+}
+
+void background_image_copy_to(struct background_image *image,
+		unsigned char *data, int stride, int width, int height, int x, int y) {
+	// Clip the image to the destination
+	int src_x = x < 0 ? -x : 0;
+	int src_y = y < 0 ? -y : 0;
+	int dst_x = x < 0 ? 0 : x;
+	int dst_y = y < 0 ? 0 : y;
+	int copy_width = image->width - src_x;
+	if (copy_width > width - dst_x) {
+		copy_width = width - dst_x;
+	}
+	int copy_height = image->height - src_y;
+	if (copy_height > height - dst_y) {
+		copy_height = height - dst_y;
+	}
+	if (copy_width <= 0 || copy_height <= 0) {
+		return;
+	}
+
+	const unsigned char *src;
+	int src_stride, bpp;
+	void (*copy_row)(uint8_t *, const uint8_t *, int);
+#if HAVE_GDK_PIXBUF
+	if (image->pixbuf) {
+		src = gdk_pixbuf_read_pixels(image->pixbuf);
+		src_stride = gdk_pixbuf_get_rowstride(image->pixbuf);
+		bpp = gdk_pixbuf_get_n_channels(image->pixbuf);
+		copy_row = bpp == 3 ? convert_rgb_row : premultiply_rgba_row;
+	} else
+#endif
+	{
+		cairo_surface_flush(image->surface);
+		src = cairo_image_surface_get_data(image->surface);
+		src_stride = cairo_image_surface_get_stride(image->surface);
+		bpp = 4;
+		copy_row = copy_argb_row;
+	}
+
+	src += (size_t)src_y * src_stride + (size_t)src_x * bpp;
+	data += (size_t)dst_y * stride + (size_t)dst_x * 4;
+	for (int i = 0; i < copy_height; ++i) {
+		copy_row(data, src, copy_width);
+		src += src_stride;
+		data += stride;
+	}
 }
 
 void render_background_image(cairo_t *cairo, cairo_surface_t *image,
@@ -108,6 +483,7 @@ void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 		cairo_pattern_t *pattern = cairo_pattern_create_for_surface(image);
 		cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
 		cairo_set_source(cairo, pattern);
+		cairo_pattern_destroy(pattern);
 		break;
 	}
 	case BACKGROUND_MODE_SOLID_COLOR:
@@ -118,3 +494,126 @@ void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 	cairo_paint(cairo);
 	cairo_restore(cairo);
 }
+
+struct render_band {
+	struct thread_pool_task task;
+	cairo_surface_t *image;
+	enum background_mode mode;
+	uint32_t color;
+	int buffer_width, buffer_height;
+
+	unsigned char *data;
+	cairo_format_t format;
+	int stride, y, height;
+};
+
+static void render_band_task(struct thread_pool_task *task) {
+	struct render_band *band = wl_container_of(task, band, task);
+	// Every band draws the whole buffer with the same transform and is only
+	// clipped to its rows, so that the result matches an unbanded render
+	// bit for bit. Cairo does not touch pixels outside of the clip.
+	cairo_surface_t *surface = cairo_image_surface_create_for_data(
+			band->data, band->format, band->buffer_width,
+			band->buffer_height, band->stride);
+
+	cairo_t *cairo = cairo_create(surface);
+	cairo_rectangle(cairo, 0, band->y, band->buffer_width, band->height);
+	cairo_clip(cairo);
+	// Replace whatever the target held before, even with a transparent color
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_u32(cairo, band->color);
+	cairo_paint(cairo);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
+	render_background_image(cairo, band->image, band->mode,
+			band->buffer_width, band->buffer_height);
+	cairo_destroy(cairo);
+	cairo_surface_destroy(surface);
+}
+
+bool render_background_image_banded(cairo_surface_t *target,
+		cairo_surface_t *image, enum background_mode mode, uint32_t color,
+		struct thread_pool *pool) {
+	int width = cairo_image_surface_get_width(target);
+	int height = cairo_image_surface_get_height(target);
+	int num_bands = (height + RENDER_BAND_HEIGHT - 1) / RENDER_BAND_HEIGHT;
+	struct render_band *bands = calloc(num_bands, sizeof(struct render_band));
+	if (!bands) {
+		swaybg_log(LOG_ERROR, "Failed to allocate render bands");
+		return false;
+	}
+
+	cairo_surface_flush(target);
+	unsigned char *data = cairo_image_surface_get_data(target);
+	cairo_format_t format = cairo_image_surface_get_format(target);
+	int stride = cairo_image_surface_get_stride(target);
+	for (int i = 0; i < num_bands; ++i) {
+		struct render_band *band = &bands[i];
+		band->image = image;
+		band->mode = mode;
+		band->color = color;
+		band->buffer_width = width;
+		band->buffer_height = height;
+		band->data = data;
+		band->format = format;
+		band->stride = stride;
+		band->y = i * RENDER_BAND_HEIGHT;
+		band->height = height - band->y < RENDER_BAND_HEIGHT ?
+			height - band->y : RENDER_BAND_HEIGHT;
+		thread_pool_submit(pool, &band->task, render_band_task);
+	}
+	for (int i = 0; i < num_bands; ++i) {
+		thread_pool_wait(pool, &bands[i].task);
+	}
+	cairo_surface_mark_dirty(target);
+
+	free(bands);
+	return true;
+}
+
+struct blend_band {
+	struct thread_pool_task task;
+	uint8_t *dst;
+	const uint8_t *a, *b;
+	int width, stride, height;
+	unsigned weight;
+};
+
+static void blend_band_task(struct thread_pool_task *task) {
+	struct blend_band *band = wl_container_of(task, band, task);
+	for (int y = 0; y < band->height; ++y) {
+		size_t offset = (size_t)y * band->stride;
+		blend_row(band->dst + offset, band->a + offset, band->b + offset,
+				band->width, band->weight);
+	}
+}
+
+bool blend_images_banded(void *dst, const void *a, const void *b,
+		int width, int height, int stride, unsigned weight,
+		struct thread_pool *pool) {
+	int num_bands = (height + RENDER_BAND_HEIGHT - 1) / RENDER_BAND_HEIGHT;
+	struct blend_band *bands = calloc(num_bands, sizeof(struct blend_band));
+	if (!bands) {
+		swaybg_log(LOG_ERROR, "Failed to allocate blend bands");
+		return false;
+	}
+
+	for (int i = 0; i < num_bands; ++i) {
+		struct blend_band *band = &bands[i];
+		size_t offset = (size_t)i * RENDER_BAND_HEIGHT * stride;
+		band->dst = (uint8_t *)dst + offset;
+		band->a = (const uint8_t *)a + offset;
+		band->b = (const uint8_t *)b + offset;
+		band->width = width;
+		band->stride = stride;
+		band->height = height - i * RENDER_BAND_HEIGHT < RENDER_BAND_HEIGHT ?
+			height - i * RENDER_BAND_HEIGHT : RENDER_BAND_HEIGHT;
+		band->weight = weight;
+		thread_pool_submit(pool, &band->task, blend_band_task);
+	}
+	for (int i = 0; i < num_bands; ++i) {
+		thread_pool_wait(pool, &bands[i].task);
+	}
+
+	free(bands);
+	return true;
+}
@@ -0,0 +1,283 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "background-image.h"
+#include "cairo.h"
+#include "log.h"
+#include "thread-pool.h"
+
+/*
+ * Measures the decode, convert and render paths without a compositor, on
+ * images generated at startup. Every result is printed as one JSON object
+ * per line. Arguments restrict the run to the benchmarks whose description
+ * contains all of them, e.g. "render" "\"target\":\"4k\"".
+ */
+
+// Each benchmark runs for at least this long and this many iterations
+#define MIN_RUN_TIME_NS 200000000LL
+#define MIN_ITERATIONS 3
+
+struct resolution {
+	const char *name;
+	int width, height;
+};
+
+static const struct resolution resolutions[] = {
+	{ "1080p", 1920, 1080 },
+	{ "4k", 3840, 2160 },
+	{ "8k", 7680, 4320 },
+};
+
+#define NUM_RESOLUTIONS (sizeof(resolutions) / sizeof(resolutions[0]))
+
+static const struct {
+	const char *name;
+	enum background_mode mode;
+} modes[] = {
+	{ "stretch", BACKGROUND_MODE_STRETCH },
+	{ "fill", BACKGROUND_MODE_FILL },
+	{ "fit", BACKGROUND_MODE_FIT },
+	{ "center", BACKGROUND_MODE_CENTER },
+	{ "tile", BACKGROUND_MODE_TILE },
+};
+
+static char **filters;
+static int num_filters;
+
+static int64_t get_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool is_selected(const char *description) {
+	for (int i = 0; i < num_filters; ++i) {
+		if (!strstr(description, filters[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Runs the benchmark and prints its result. Both pixels and bytes are per
+ * iteration; bytes are what the benchmark writes.
+ */
+static void run_benchmark(const char *description, int64_t pixels,
+		int64_t bytes, void (*run)(void *data), void *data) {
+	if (!is_selected(description)) {
+		return;
+	}
+	run(data);  // warm up
+
+	int iterations = 0;
+	int64_t start = get_time_ns(), elapsed;
+	do {
+		run(data);
+		iterations++;
+		elapsed = get_time_ns() - start;
+	} while (elapsed < MIN_RUN_TIME_NS || iterations < MIN_ITERATIONS);
+
+	double ns = (double)elapsed / iterations;
+	printf("{%s,\"iterations\":%d,\"ns_per_pixel\":%.4f,\"mb_per_s\":%.1f}\n",
+			description, iterations, ns / pixels, bytes / ns * 1e3);
+	fflush(stdout);
+}
+
+/**
+ * Writes a PNG with smooth gradients, like a typical wallpaper, so that it
+ * decodes at a realistic speed.
+ */
+static bool generate_image(const char *path, int width, int height) {
+	cairo_surface_t *surface =
+		cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	cairo_t *cairo = cairo_create(surface);
+	cairo_pattern_t *linear = cairo_pattern_create_linear(0, 0, width, height);
+	cairo_pattern_add_color_stop_rgb(linear, 0, 0.1, 0.2, 0.5);
+	cairo_pattern_add_color_stop_rgb(linear, 1, 0.9, 0.5, 0.2);
+	cairo_set_source(cairo, linear);
+	cairo_paint(cairo);
+	cairo_pattern_destroy(linear);
+	cairo_pattern_t *radial = cairo_pattern_create_radial(width / 3.0,
+			height / 3.0, 0, width / 3.0, height / 3.0, height / 2.0);
+	cairo_pattern_add_color_stop_rgba(radial, 0, 1, 1, 1, 0.8);
+	cairo_pattern_add_color_stop_rgba(radial, 1, 1, 1, 1, 0);
+	cairo_set_source(cairo, radial);
+	cairo_paint(cairo);
+	cairo_pattern_destroy(radial);
+	cairo_destroy(cairo);
+
+	cairo_status_t status = cairo_surface_write_to_png(surface, path);
+	cairo_surface_destroy(surface);
+	if (status != CAIRO_STATUS_SUCCESS) {
+		swaybg_log(LOG_ERROR, "Failed to write %s: %s", path,
+				cairo_status_to_string(status));
+		return false;
+	}
+	return true;
+}
+
+struct decode_data {
+	const char *path;
+	double scale;
+};
+
+static void run_decode(void *data) {
+	struct decode_data *decode = data;
+	destroy_background_image(load_background_image(decode->path,
+				decode->scale));
+}
+
+#if HAVE_GDK_PIXBUF
+static void run_convert(void *data) {
+	cairo_surface_destroy(gdk_cairo_image_surface_create_from_pixbuf(data));
+}
+#endif
+
+struct render_data {
+	cairo_surface_t *image, *target;
+	enum background_mode mode;
+	struct thread_pool *pool;
+};
+
+static void run_render(void *data) {
+	struct render_data *render = data;
+	cairo_t *cairo = cairo_create(render->target);
+	render_background_image(cairo, render->image, render->mode,
+			cairo_image_surface_get_width(render->target),
+			cairo_image_surface_get_height(render->target));
+	cairo_destroy(cairo);
+}
+
+static void run_render_banded(void *data) {
+	struct render_data *render = data;
+	render_background_image_banded(render->target, render->image,
+			render->mode, 0, render->pool);
+}
+
+static void benchmark_decode(const struct resolution *source,
+		const char *path) {
+	static const double scales[] = { 1.0, 0.5 };
+	int64_t pixels = (int64_t)source->width * source->height;
+	for (size_t i = 0; i < sizeof(scales) / sizeof(scales[0]); ++i) {
+		struct decode_data data = { .path = path, .scale = scales[i] };
+		char description[256];
+		snprintf(description, sizeof(description),
+				"\"benchmark\":\"decode\",\"source\":\"%s\",\"scale\":%.2f",
+				source->name, scales[i]);
+		// Measured against the pixels of the file, which all get decoded
+		run_benchmark(description, pixels,
+				(int64_t)(pixels * scales[i] * scales[i]) * 4,
+				run_decode, &data);
+	}
+}
+
+static void benchmark_convert(const struct resolution *source,
+		struct background_image *image) {
+#if HAVE_GDK_PIXBUF
+	if (!image->pixbuf) {
+		return;
+	}
+	int64_t pixels = (int64_t)source->width * source->height;
+	char description[256];
+	snprintf(description, sizeof(description),
+			"\"benchmark\":\"convert\",\"source\":\"%s\",\"channels\":3",
+			source->name);
+	run_benchmark(description, pixels, pixels * 4, run_convert, image->pixbuf);
+
+	GdkPixbuf *rgba = gdk_pixbuf_add_alpha(image->pixbuf, FALSE, 0, 0, 0);
+	if (rgba) {
+		snprintf(description, sizeof(description),
+				"\"benchmark\":\"convert\",\"source\":\"%s\",\"channels\":4",
+				source->name);
+		run_benchmark(description, pixels, pixels * 4, run_convert, rgba);
+		g_object_unref(rgba);
+	}
+#endif
+}
+
+static void benchmark_render(const struct resolution *source,
+		cairo_surface_t *image, struct thread_pool *pool) {
+	for (size_t i = 0; i < NUM_RESOLUTIONS; ++i) {
+		const struct resolution *target = &resolutions[i];
+		struct render_data data = {
+			.image = image,
+			.target = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+					target->width, target->height),
+			.pool = pool,
+		};
+		int64_t pixels = (int64_t)target->width * target->height;
+		for (size_t j = 0; j < sizeof(modes) / sizeof(modes[0]); ++j) {
+			data.mode = modes[j].mode;
+			char description[256];
+			snprintf(description, sizeof(description),
+					"\"benchmark\":\"render\",\"source\":\"%s\","
+					"\"target\":\"%s\",\"mode\":\"%s\"",
+					source->name, target->name, modes[j].name);
+			run_benchmark(description, pixels, pixels * 4,
+					run_render, &data);
+			snprintf(description, sizeof(description),
+					"\"benchmark\":\"render_banded\",\"source\":\"%s\","
+					"\"target\":\"%s\",\"mode\":\"%s\",\"threads\":%zu",
+					source->name, target->name, modes[j].name,
+					thread_pool_get_num_threads(pool));
+			run_benchmark(description, pixels, pixels * 4,
+					run_render_banded, &data);
+		}
+		cairo_surface_destroy(data.target);
+	}
+}
+
+int main(int argc, char **argv) {
+	swaybg_log_init(LOG_ERROR);
+	filters = argv + 1;
+	num_filters = argc - 1;
+
+	const char *tmpdir = getenv("TMPDIR");
+	char dir[256];
+	snprintf(dir, sizeof(dir), "%s/swaybg-benchmark-XXXXXX",
+			tmpdir ? tmpdir : "/tmp");
+	if (!mkdtemp(dir)) {
+		swaybg_log_errno(LOG_ERROR, "Failed to create %s", dir);
+		return EXIT_FAILURE;
+	}
+
+	struct thread_pool *pool = thread_pool_create(0);
+	if (!pool) {
+		return EXIT_FAILURE;
+	}
+
+	int ret = EXIT_SUCCESS;
+	for (size_t i = 0; i < NUM_RESOLUTIONS; ++i) {
+		const struct resolution *source = &resolutions[i];
+		char path[512];
+		snprintf(path, sizeof(path), "%s/%s.png", dir, source->name);
+		if (!generate_image(path, source->width, source->height)) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		benchmark_decode(source, path);
+		struct background_image *image = load_background_image(path, 1.0);
+		unlink(path);
+		if (!image) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+		benchmark_convert(source, image);
+		cairo_surface_t *surface = background_image_get_surface(image);
+		if (surface) {
+			benchmark_render(source, surface, pool);
+		}
+		destroy_background_image(image);
+	}
+
+	thread_pool_destroy(pool);
+	rmdir(dir);
+	return ret;
+}
@@ -0,0 +1,245 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "control.h"
+#include "log.h"
+
+struct control_client {
+	int fd;
+	char buf[CONTROL_MAX_LINE];
+	size_t len;
+	struct wl_list link;  // struct control_socket::clients
+};
+
+/**
+ * Removes a socket a previous instance left behind at the address. Anything
+ * else there, including the socket of an instance that is still running, is
+ * left alone and makes this fail.
+ */
+static bool remove_stale_socket(const struct sockaddr_un *addr) {
+	struct stat st;
+	if (lstat(addr->sun_path, &st) < 0) {
+		return errno == ENOENT;
+	}
+	if (!S_ISSOCK(st.st_mode)) {
+		swaybg_log(LOG_ERROR, "Not replacing %s, which is not a socket",
+				addr->sun_path);
+		return false;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to create control socket");
+		return false;
+	}
+	bool live = connect(fd, (const struct sockaddr *)addr,
+			sizeof(*addr)) == 0 || errno != ECONNREFUSED;
+	close(fd);
+	if (live) {
+		swaybg_log(LOG_ERROR, "Control socket %s is in use by another "
+				"instance", addr->sun_path);
+		return false;
+	}
+	if (unlink(addr->sun_path) < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to remove %s", addr->sun_path);
+		return false;
+	}
+	return true;
+}
+
+bool control_socket_init(struct control_socket *control, const char *path,
+		control_handler_t handler, void *data) {
+	memset(control, 0, sizeof(struct control_socket));
+	wl_list_init(&control->clients);
+	control->handler = handler;
+	control->data = data;
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		swaybg_log(LOG_ERROR, "Control socket path is too long: %s", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	control->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			0);
+	if (control->fd < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to create control socket");
+		return false;
+	}
+	if (!remove_stale_socket(&addr)) {
+		close(control->fd);
+		control->fd = -1;
+		return false;
+	}
+	if (bind(control->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(control->fd, CONTROL_MAX_CLIENTS) < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to listen on %s", path);
+		close(control->fd);
+		control->fd = -1;
+		return false;
+	}
+	control->path = strdup(path);
+	swaybg_log(LOG_DEBUG, "Listening for commands on %s", path);
+	return true;
+}
+
+static void destroy_client(struct control_socket *control,
+		struct control_client *client) {
+	wl_list_remove(&client->link);
+	control->num_clients--;
+	close(client->fd);
+	free(client);
+}
+
+void control_socket_finish(struct control_socket *control) {
+	struct control_client *client, *tmp;
+	wl_list_for_each_safe(client, tmp, &control->clients, link) {
+		destroy_client(control, client);
+	}
+	if (control->fd >= 0) {
+		close(control->fd);
+	}
+	if (control->path) {
+		unlink(control->path);
+		free(control->path);
+	}
+	memset(control, 0, sizeof(struct control_socket));
+	control->fd = -1;
+}
+
+size_t control_socket_get_pollfds(struct control_socket *control,
+		struct pollfd *fds) {
+	if (control->fd < 0) {
+		return 0;
+	}
+	size_t n = 0;
+	fds[n++] = (struct pollfd){ .fd = control->fd, .events = POLLIN };
+	struct control_client *client;
+	wl_list_for_each(client, &control->clients, link) {
+		fds[n++] = (struct pollfd){ .fd = client->fd, .events = POLLIN };
+	}
+	return n;
+}
+
+static void accept_client(struct control_socket *control) {
+	int fd = accept(control->fd, NULL, NULL);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			swaybg_log_errno(LOG_ERROR, "Failed to accept control client");
+		}
+		return;
+	}
+	if (control->num_clients >= CONTROL_MAX_CLIENTS) {
+		swaybg_log(LOG_INFO, "Too many control clients, rejecting one");
+		close(fd);
+		return;
+	}
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+		close(fd);
+		return;
+	}
+	struct control_client *client = calloc(1, sizeof(struct control_client));
+	if (!client) {
+		swaybg_log(LOG_ERROR, "Failed to allocate control client");
+		close(fd);
+		return;
+	}
+	client->fd = fd;
+	wl_list_insert(control->clients.prev, &client->link);
+	control->num_clients++;
+}
+
+static void reply(struct control_client *client, const char *error,
+		const char *note) {
+	char msg[CONTROL_MAX_LINE];
+	int len;
+	if (error) {
+		len = snprintf(msg, sizeof(msg), "error: %s\n", error);
+	} else if (note) {
+		len = snprintf(msg, sizeof(msg), "ok: %s\n", note);
+	} else {
+		len = snprintf(msg, sizeof(msg), "ok\n");
+	}
+	if (len >= (int)sizeof(msg)) {
+		len = sizeof(msg) - 1;
+		msg[len - 1] = '\n';
+	}
+	// Clients are expected to read their replies; one that does not only
+	// misses them
+	if (send(client->fd, msg, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+		swaybg_log_errno(LOG_DEBUG, "Failed to reply to control client");
+	}
+}
+
+static void run_command(struct control_socket *control,
+		struct control_client *client, char *line) {
+	const char *note = NULL;
+	const char *error = control->handler(control->data, line, &note);
+	reply(client, error, note);
+}
+
+/**
+ * Returns false once the client should be disconnected.
+ */
+static bool read_client(struct control_socket *control,
+		struct control_client *client) {
+	// Leave room to terminate the last line
+	ssize_t n = read(client->fd, client->buf + client->len,
+			sizeof(client->buf) - 1 - client->len);
+	if (n < 0) {
+		return errno == EAGAIN || errno == EINTR;
+	} else if (n == 0) {
+		if (client->len > 0) {
+			// The last command does not need a trailing newline
+			client->buf[client->len] = '\0';
+			run_command(control, client, client->buf);
+		}
+		return false;
+	}
+	client->len += n;
+
+	char *line = client->buf, *end;
+	while ((end = memchr(line, '\n', client->buf + client->len - line))) {
+		*end = '\0';
+		run_command(control, client, line);
+		line = end + 1;
+	}
+	client->len -= line - client->buf;
+	memmove(client->buf, line, client->len);
+	if (client->len == sizeof(client->buf) - 1) {
+		reply(client, "command too long", NULL);
+		return false;
+	}
+	return true;
+}
+
+void control_socket_dispatch(struct control_socket *control,
+		const struct pollfd *fds, size_t num_fds) {
+	if (num_fds == 0) {
+		return;
+	}
+	// Clients are in the same order as their fds; new ones are only added
+	// after all of those have been handled
+	size_t i = 1;
+	struct control_client *client, *tmp;
+	wl_list_for_each_safe(client, tmp, &control->clients, link) {
+		if (i >= num_fds) {
+			break;
+		}
+		const struct pollfd *pfd = &fds[i++];
+		if (pfd->revents & (POLLIN | POLLHUP | POLLERR) &&
+				!read_client(control, client)) {
+			destroy_client(control, client);
+		}
+	}
+	if (fds[0].revents & POLLIN) {
+		accept_client(control);
+	}
+}
@@ -0,0 +1,373 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "disk-cache.h"
+#include "log.h"
+
+#define DATA_ALIGN 4096
+#define ENTRY_SUFFIX ".frame"
+
+static const char magic[8] = "swaybg\0\1";
+
+struct disk_cache_header {
+	char magic[8];
+	uint32_t key_length;
+	uint32_t format;
+	uint32_t width, height, stride;
+	uint32_t data_offset;
+};
+
+static bool make_dir(const char *path) {
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		swaybg_log_errno(LOG_INFO, "Failed to create %s", path);
+		return false;
+	}
+	return true;
+}
+
+void disk_cache_init(struct disk_cache *cache, uint64_t max_size) {
+	cache->dir = NULL;
+	cache->max_size = max_size;
+
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	char parent[4096];
+	if (base && base[0] == '/') {
+		snprintf(parent, sizeof(parent), "%s", base);
+	} else if (home) {
+		snprintf(parent, sizeof(parent), "%s/.cache", home);
+	} else {
+		swaybg_log(LOG_INFO, "Neither XDG_CACHE_HOME nor HOME are set, "
+				"not caching frames");
+		return;
+	}
+
+	size_t size = strlen(parent) + strlen("/swaybg") + 1;
+	char *dir = malloc(size);
+	if (!dir) {
+		swaybg_log(LOG_ERROR, "Failed to allocate cache path");
+		return;
+	}
+	snprintf(dir, size, "%s/swaybg", parent);
+	if (!make_dir(parent) || !make_dir(dir)) {
+		free(dir);
+		return;
+	}
+	cache->dir = dir;
+}
+
+void disk_cache_finish(struct disk_cache *cache) {
+	free(cache->dir);
+	cache->dir = NULL;
+}
+
+/**
+ * Builds the full key string, which is stored in the entry to rule out hash
+ * collisions, and the path of the entry.
+ */
+static char *get_key_string(struct disk_cache *cache,
+		const struct disk_cache_key *key, char **entry_path) {
+	if (!cache->dir || key->file_size < 0) {
+		return NULL;
+	}
+
+	char *str = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&str, &len);
+	if (!f) {
+		return NULL;
+	}
+	fprintf(f, "%s\n%lld.%09ld %lld\n%d %08x %dx%d %d", key->path,
+			(long long)key->mtime.tv_sec, (long)key->mtime.tv_nsec,
+			(long long)key->file_size, (int)key->mode, key->color,
+			key->width, key->height, key->rgb565);
+	if (fclose(f) != 0) {
+		free(str);
+		return NULL;
+	}
+
+	// 64-bit FNV-1a
+	uint64_t hash = 0xcbf29ce484222325;
+	for (size_t i = 0; i < len; ++i) {
+		hash = (hash ^ (unsigned char)str[i]) * 0x100000001b3;
+	}
+	size_t path_size = strlen(cache->dir) + 1 + 16 + strlen(ENTRY_SUFFIX) + 1;
+	*entry_path = malloc(path_size);
+	if (!*entry_path) {
+		free(str);
+		return NULL;
+	}
+	snprintf(*entry_path, path_size, "%s/%016llx" ENTRY_SUFFIX, cache->dir,
+			(unsigned long long)hash);
+	return str;
+}
+
+static bool read_all(int fd, void *data, size_t size, off_t offset) {
+	char *p = data;
+	while (size > 0) {
+		ssize_t n = pread(fd, p, size, offset);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+static bool write_all(int fd, const void *data, size_t size, off_t offset) {
+	const char *p = data;
+	while (size > 0) {
+		ssize_t n = pwrite(fd, p, size, offset);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+
+/**
+ * Returns the stride buffers of the format use, or 0 if frames are never
+ * stored in that format.
+ */
+static int get_stride(uint32_t format, int width) {
+	switch (format) {
+	case WL_SHM_FORMAT_ARGB8888:
+		return cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, width);
+	case WL_SHM_FORMAT_XRGB8888:
+		return cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, width);
+	case WL_SHM_FORMAT_RGB565:
+		return cairo_format_stride_for_width(CAIRO_FORMAT_RGB16_565, width);
+	}
+	return 0;
+}
+
+static bool check_entry(int fd, const char *key_str,
+		const struct disk_cache_key *key, struct disk_cache_header *header) {
+	// A damaged or foreign entry is a miss, rather than a frame that
+	// cannot be shown or is read with the wrong layout
+	if (!read_all(fd, header, sizeof(*header), 0) ||
+			memcmp(header->magic, magic, sizeof(magic)) != 0 ||
+			header->key_length != strlen(key_str) ||
+			header->width != (uint32_t)key->width ||
+			header->height != (uint32_t)key->height ||
+			header->stride == 0 ||
+			header->stride != (uint32_t)get_stride(header->format,
+				key->width) ||
+			header->data_offset % DATA_ALIGN != 0) {
+		return false;
+	}
+	char *stored = malloc(header->key_length);
+	if (!stored) {
+		return false;
+	}
+	bool match = read_all(fd, stored, header->key_length, sizeof(*header)) &&
+		memcmp(stored, key_str, header->key_length) == 0;
+	free(stored);
+	return match;
+}
+
+bool disk_cache_open(struct disk_cache *cache, const struct disk_cache_key *key,
+		struct disk_cache_entry *entry) {
+	char *entry_path = NULL;
+	char *key_str = get_key_string(cache, key, &entry_path);
+	if (!key_str) {
+		return false;
+	}
+
+	bool found = false;
+	int fd = open(entry_path, O_RDONLY | O_CLOEXEC);
+	struct disk_cache_header header;
+	if (fd >= 0 && check_entry(fd, key_str, key, &header)) {
+		// Entries are evicted by age, so mark this one as recently used
+		futimens(fd, NULL);
+		entry->fd = fd;
+		entry->format = header.format;
+		entry->stride = header.stride;
+		entry->data_offset = header.data_offset;
+		found = true;
+	} else if (fd >= 0) {
+		close(fd);
+	}
+	swaybg_log(LOG_DEBUG, "Frame cache %s for %s at %dx%d",
+			found ? "hit" : "miss", key->path, key->width, key->height);
+
+	free(key_str);
+	free(entry_path);
+	return found;
+}
+
+bool disk_cache_read(struct disk_cache_entry *entry, void *data, int height) {
+	return read_all(entry->fd, data, (size_t)entry->stride * height,
+			entry->data_offset);
+}
+
+void disk_cache_close(struct disk_cache_entry *entry) {
+	close(entry->fd);
+	entry->fd = -1;
+}
+
+struct cached_file {
+	char *name;
+	off_t size;
+	struct timespec mtime;
+};
+
+static int compare_age(const void *a, const void *b) {
+	const struct cached_file *fa = a, *fb = b;
+	if (fa->mtime.tv_sec != fb->mtime.tv_sec) {
+		return fa->mtime.tv_sec < fb->mtime.tv_sec ? -1 : 1;
+	}
+	if (fa->mtime.tv_nsec != fb->mtime.tv_nsec) {
+		return fa->mtime.tv_nsec < fb->mtime.tv_nsec ? -1 : 1;
+	}
+	return 0;
+}
+
+static void evict_entries(struct disk_cache *cache) {
+	DIR *dir = opendir(cache->dir);
+	if (!dir) {
+		return;
+	}
+
+	struct cached_file *files = NULL;
+	size_t num_files = 0, cap = 0;
+	uint64_t total = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		size_t len = strlen(ent->d_name);
+		size_t suffix_len = strlen(ENTRY_SUFFIX);
+		struct stat st;
+		if (len <= suffix_len ||
+				strcmp(ent->d_name + len - suffix_len, ENTRY_SUFFIX) != 0 ||
+				fstatat(dirfd(dir), ent->d_name, &st, 0) < 0 ||
+				!S_ISREG(st.st_mode)) {
+			continue;
+		}
+		if (num_files == cap) {
+			cap = cap ? cap * 2 : 16;
+			struct cached_file *new_files =
+				realloc(files, cap * sizeof(struct cached_file));
+			if (!new_files) {
+				break;
+			}
+			files = new_files;
+		}
+		char *name = strdup(ent->d_name);
+		if (!name) {
+			break;
+		}
+		files[num_files++] = (struct cached_file){
+			.name = name,
+			.size = st.st_size,
+			.mtime = st.st_mtim,
+		};
+		total += st.st_size;
+	}
+
+	qsort(files, num_files, sizeof(struct cached_file), compare_age);
+	for (size_t i = 0; i < num_files; ++i) {
+		if (total > cache->max_size) {
+			swaybg_log(LOG_DEBUG, "Evicting cached frame %s", files[i].name);
+			if (unlinkat(dirfd(dir), files[i].name, 0) == 0) {
+				total -= files[i].size;
+			}
+		}
+		free(files[i].name);
+	}
+	free(files);
+	closedir(dir);
+}
+
+/**
+ * Marks an existing entry as recently used, if there is one.
+ */
+static bool refresh_entry(const char *key_str, const char *entry_path,
+		const struct disk_cache_key *key) {
+	int fd = open(entry_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	struct disk_cache_header header;
+	bool found = check_entry(fd, key_str, key, &header);
+	if (found) {
+		futimens(fd, NULL);
+	}
+	close(fd);
+	return found;
+}
+
+static void write_entry(struct disk_cache *cache,
+		const struct disk_cache_key *key, const char *key_str,
+		const char *entry_path, uint32_t format, const void *data,
+		int stride) {
+	struct disk_cache_header header = {
+		.key_length = strlen(key_str),
+		.format = format,
+		.width = key->width,
+		.height = key->height,
+		.stride = stride,
+	};
+	memcpy(header.magic, magic, sizeof(magic));
+	header.data_offset = (sizeof(header) + header.key_length + DATA_ALIGN - 1) /
+		DATA_ALIGN * DATA_ALIGN;
+
+	// Write to a temporary file first, so that a concurrent reader never
+	// sees a partial entry
+	size_t tmp_size = strlen(entry_path) + strlen(".XXXXXX") + 1;
+	char *tmp_path = malloc(tmp_size);
+	if (!tmp_path) {
+		return;
+	}
+	snprintf(tmp_path, tmp_size, "%s.XXXXXX", entry_path);
+	int fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		swaybg_log_errno(LOG_INFO, "Failed to create cache file");
+		free(tmp_path);
+		return;
+	}
+	bool ok = write_all(fd, &header, sizeof(header), 0) &&
+		write_all(fd, key_str, header.key_length, sizeof(header)) &&
+		write_all(fd, data, (size_t)stride * key->height, header.data_offset);
+	close(fd);
+	if (ok && rename(tmp_path, entry_path) == 0) {
+		swaybg_log(LOG_DEBUG, "Stored frame for %s at %dx%d in the cache",
+				key->path, key->width, key->height);
+		evict_entries(cache);
+	} else {
+		swaybg_log_errno(LOG_INFO, "Failed to write cache file");
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+}
+
+void disk_cache_store(struct disk_cache *cache, const struct disk_cache_key *key,
+		uint32_t format, const void *data, int stride) {
+	if ((uint64_t)stride * key->height > cache->max_size) {
+		return;
+	}
+	char *entry_path = NULL;
+	char *key_str = get_key_string(cache, key, &entry_path);
+	if (key_str && !refresh_entry(key_str, entry_path, key)) {
+		write_entry(cache, key, key_str, entry_path, format, data, stride);
+	}
+	free(key_str);
+	free(entry_path);
+}
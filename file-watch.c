@@ -0,0 +1,199 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "config.h"
+#include "file-watch.h"
+#include "log.h"
+#if HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+struct watched_file {
+	char *path;  // as passed to file_watcher_add
+	char *name;  // within the directory
+	struct wl_list link;  // struct watched_dir::files
+};
+
+struct watched_dir {
+	int wd;
+	char *path;
+	struct wl_list files;  // struct watched_file::link
+	struct wl_list link;  // struct file_watcher::dirs
+};
+
+void file_watcher_init(struct file_watcher *watcher,
+		file_watch_handler_t handler, void *data) {
+	watcher->fd = -1;
+	wl_list_init(&watcher->dirs);
+	watcher->handler = handler;
+	watcher->data = data;
+#if HAVE_INOTIFY
+	watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watcher->fd < 0) {
+		swaybg_log_errno(LOG_INFO, "Failed to initialize inotify, "
+				"image files will not be reloaded");
+	}
+#endif
+}
+
+static void destroy_file(struct watched_file *file) {
+	wl_list_remove(&file->link);
+	free(file->path);
+	free(file->name);
+	free(file);
+}
+
+static void destroy_dir(struct watched_dir *dir) {
+	struct watched_file *file, *tmp;
+	wl_list_for_each_safe(file, tmp, &dir->files, link) {
+		destroy_file(file);
+	}
+	wl_list_remove(&dir->link);
+	free(dir->path);
+	free(dir);
+}
+
+void file_watcher_finish(struct file_watcher *watcher) {
+	struct watched_dir *dir, *tmp;
+	wl_list_for_each_safe(dir, tmp, &watcher->dirs, link) {
+		destroy_dir(dir);
+	}
+	if (watcher->fd >= 0) {
+		close(watcher->fd);
+		watcher->fd = -1;
+	}
+}
+
+static struct watched_dir *add_dir(struct file_watcher *watcher,
+		const char *path) {
+	struct watched_dir *dir;
+	wl_list_for_each(dir, &watcher->dirs, link) {
+		if (strcmp(dir->path, path) == 0) {
+			return dir;
+		}
+	}
+
+#if HAVE_INOTIFY
+	int wd = inotify_add_watch(watcher->fd, path,
+			IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (wd < 0) {
+		swaybg_log_errno(LOG_INFO, "Failed to watch %s", path);
+		return NULL;
+	}
+#else
+	int wd = -1;
+#endif
+	dir = calloc(1, sizeof(struct watched_dir));
+	if (!dir) {
+		swaybg_log(LOG_ERROR, "Failed to allocate watched directory");
+		return NULL;
+	}
+	dir->wd = wd;
+	dir->path = strdup(path);
+	wl_list_init(&dir->files);
+	wl_list_insert(&watcher->dirs, &dir->link);
+	return dir;
+}
+
+void file_watcher_add(struct file_watcher *watcher, const char *path) {
+	if (watcher->fd < 0) {
+		return;
+	}
+	const char *slash = strrchr(path, '/');
+	char *dir_path = slash ? strndup(path, slash == path ? 1 : slash - path) :
+		strdup(".");
+	if (!dir_path) {
+		return;
+	}
+	struct watched_dir *dir = add_dir(watcher, dir_path);
+	free(dir_path);
+	if (!dir) {
+		return;
+	}
+
+	struct watched_file *file;
+	wl_list_for_each(file, &dir->files, link) {
+		if (strcmp(file->path, path) == 0) {
+			return;
+		}
+	}
+	file = calloc(1, sizeof(struct watched_file));
+	if (!file) {
+		swaybg_log(LOG_ERROR, "Failed to allocate watched file");
+		return;
+	}
+	file->path = strdup(path);
+	file->name = strdup(slash ? slash + 1 : path);
+	wl_list_insert(&dir->files, &file->link);
+}
+
+void file_watcher_remove(struct file_watcher *watcher, const char *path) {
+	struct watched_dir *dir;
+	wl_list_for_each(dir, &watcher->dirs, link) {
+		struct watched_file *file;
+		wl_list_for_each(file, &dir->files, link) {
+			if (strcmp(file->path, path) != 0) {
+				continue;
+			}
+			destroy_file(file);
+			if (wl_list_empty(&dir->files)) {
+#if HAVE_INOTIFY
+				inotify_rm_watch(watcher->fd, dir->wd);
+#endif
+				destroy_dir(dir);
+			}
+			return;
+		}
+	}
+}
+
+int file_watcher_get_fd(struct file_watcher *watcher) {
+	return watcher->fd;
+}
+
+#if HAVE_INOTIFY
+static void handle_event(struct file_watcher *watcher,
+		const struct inotify_event *event) {
+	if (event->len == 0) {
+		return;
+	}
+	struct watched_dir *dir;
+	wl_list_for_each(dir, &watcher->dirs, link) {
+		if (dir->wd != event->wd) {
+			continue;
+		}
+		struct watched_file *file;
+		wl_list_for_each(file, &dir->files, link) {
+			if (strcmp(file->name, event->name) == 0) {
+				swaybg_log(LOG_DEBUG, "%s was changed", file->path);
+				watcher->handler(watcher->data, file->path);
+			}
+		}
+	}
+}
+#endif
+
+void file_watcher_dispatch(struct file_watcher *watcher) {
+#if HAVE_INOTIFY
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	while (true) {
+		ssize_t len = read(watcher->fd, buf, sizeof(buf));
+		if (len <= 0) {
+			if (len < 0 && errno != EAGAIN) {
+				swaybg_log_errno(LOG_ERROR, "Failed to read inotify events");
+			}
+			return;
+		}
+		for (char *p = buf; p < buf + len;) {
+			const struct inotify_event *event =
+				(const struct inotify_event *)p;
+			handle_event(watcher, event);
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+#endif
+}
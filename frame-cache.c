@@ -0,0 +1,100 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "cairo.h"
+#include "frame-cache.h"
+#include "log.h"
+
+void frame_cache_init(struct frame_cache *cache, size_t max_entries) {
+	assert(max_entries > 0);
+	wl_list_init(&cache->entries);
+	cache->max_entries = max_entries;
+}
+
+static void destroy_entry(struct frame_cache_entry *entry) {
+	wl_list_remove(&entry->link);
+	cairo_surface_destroy(entry->frame);
+	free(entry);
+}
+
+void frame_cache_finish(struct frame_cache *cache) {
+	struct frame_cache_entry *entry, *tmp;
+	wl_list_for_each_safe(entry, tmp, &cache->entries, link) {
+		destroy_entry(entry);
+	}
+}
+
+static struct frame_cache_entry *find_entry(struct frame_cache *cache,
+		cairo_surface_t *image, enum background_mode mode, uint32_t color,
+		int width, int height) {
+	struct frame_cache_entry *entry;
+	wl_list_for_each(entry, &cache->entries, link) {
+		if (entry->image == image && entry->mode == mode &&
+				entry->color == color && entry->width == width &&
+				entry->height == height) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static bool insert_entry(struct frame_cache *cache,
+		cairo_surface_t *image, enum background_mode mode, uint32_t color,
+		int width, int height, cairo_surface_t *frame) {
+	struct frame_cache_entry *entry =
+		calloc(1, sizeof(struct frame_cache_entry));
+	if (!entry) {
+		swaybg_log(LOG_ERROR, "Failed to allocate frame cache entry");
+		cairo_surface_destroy(frame);
+		return false;
+	}
+	entry->image = image;
+	entry->mode = mode;
+	entry->color = color;
+	entry->width = width;
+	entry->height = height;
+	entry->frame = frame;
+	wl_list_insert(&cache->entries, &entry->link);
+
+	size_t count = 0;
+	struct frame_cache_entry *tmp;
+	wl_list_for_each_safe(entry, tmp, &cache->entries, link) {
+		if (++count > cache->max_entries) {
+			destroy_entry(entry);
+		}
+	}
+	return true;
+}
+
+cairo_surface_t *frame_cache_take(struct frame_cache *cache,
+		cairo_surface_t *image, enum background_mode mode, uint32_t color,
+		int width, int height) {
+	struct frame_cache_entry *entry =
+		find_entry(cache, image, mode, color, width, height);
+	if (!entry) {
+		return NULL;
+	}
+	cairo_surface_t *frame = entry->frame;
+	wl_list_remove(&entry->link);
+	free(entry);
+	return frame;
+}
+
+void frame_cache_insert(struct frame_cache *cache,
+		cairo_surface_t *image, enum background_mode mode, uint32_t color,
+		int width, int height, cairo_surface_t *frame) {
+	struct frame_cache_entry *entry =
+		find_entry(cache, image, mode, color, width, height);
+	if (entry) {
+		destroy_entry(entry);
+	}
+	insert_entry(cache, image, mode, color, width, height, frame);
+}
+
+void frame_cache_invalidate(struct frame_cache *cache, cairo_surface_t *image) {
+	struct frame_cache_entry *entry, *tmp;
+	wl_list_for_each_safe(entry, tmp, &cache->entries, link) {
+		if (entry->image == image) {
+			destroy_entry(entry);
+		}
+	}
+}
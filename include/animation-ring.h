@@ -0,0 +1,31 @@
+#ifndef _SWAYBG_ANIMATION_RING_H
+#define _SWAYBG_ANIMATION_RING_H
+#include <stddef.h>
+
+/**
+ * Picks the buffer slot each frame of an animation is scaled into. If every
+ * frame gets a slot of its own, frames are only ever scaled once. Otherwise
+ * the slots are used in turn, which never hands out the slot on screen, so
+ * a frame is never scaled into the buffer the compositor is showing.
+ */
+struct animation_ring {
+	size_t num_frames;
+	size_t num_slots;
+	size_t shown;  // The slot on screen, or SIZE_MAX before the first one
+};
+
+/**
+ * Uses up to max_slots slots, but at least the two needed to replace the
+ * frame on screen.
+ */
+void animation_ring_init(struct animation_ring *ring, size_t num_frames,
+		size_t max_slots);
+
+/**
+ * Returns the slot to show the frame from, which is never ring->shown unless
+ * it already holds that frame.
+ */
+size_t animation_ring_get_slot(const struct animation_ring *ring,
+		size_t frame);
+
+#endif
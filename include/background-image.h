@@ -1,7 +1,12 @@
 #ifndef _SWAY_BACKGROUND_IMAGE_H
 #define _SWAY_BACKGROUND_IMAGE_H
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
 #include "cairo.h"
 
+struct thread_pool;
+
 enum background_mode {
 	BACKGROUND_MODE_STRETCH,
 	BACKGROUND_MODE_FILL,
@@ -12,9 +17,92 @@ enum background_mode {
 	BACKGROUND_MODE_INVALID,
 };
 
+/**
+ * A frame of an animated image, including everything earlier frames left
+ * behind.
+ */
+struct background_frame {
+	cairo_surface_t *surface;
+	int delay;  // In milliseconds, or -1 if the animation stops here
+};
+
+/**
+ * A decoded background image. With gdk-pixbuf, the decoded pixels are only
+ * converted to a cairo surface once something needs to scale them; an image
+ * shown at its own size is converted straight into the buffer displaying it.
+ */
+struct background_image {
+	int width, height;
+	bool opaque;
+	cairo_surface_t *surface;
+#if HAVE_GDK_PIXBUF
+	GdkPixbuf *pixbuf;
+#endif
+	// One loop of an animated image, starting with the frame that is also
+	// the image itself. Empty for still images.
+	struct background_frame *frames;
+	size_t num_frames;
+	// Of the file just before it was read, or -1 for the size if unknown
+	struct timespec mtime;
+	off_t file_size;
+};
+
 enum background_mode parse_background_mode(const char *mode);
-cairo_surface_t *load_background_image(const char *path);
+/**
+ * Reads the size of the image file without decoding it. Returns false if
+ * that is not possible.
+ */
+bool read_background_image_size(const char *path, int *width, int *height);
+/**
+ * Returns whether the file name ends in the extension of a format that can
+ * be loaded, without looking at the file itself.
+ */
+bool has_background_image_extension(const char *path);
+/**
+ * Returns the factor, at most 1, by which an image can be shrunk before it is
+ * drawn in the given mode into a buffer of the given size, without losing
+ * any detail in the result.
+ */
+double get_background_image_scale(int image_width, int image_height,
+		enum background_mode mode, int buffer_width, int buffer_height);
+/**
+ * Decodes the image, shrunk by the given factor if the format allows it.
+ * Animations are decoded at their own size, up to a limit on the number of
+ * frames and the memory they take.
+ */
+struct background_image *load_background_image(const char *path,
+		double scale);
+void destroy_background_image(struct background_image *image);
+/**
+ * Returns the image as a cairo surface, converting it first if necessary.
+ * The surface is owned by the image.
+ */
+cairo_surface_t *background_image_get_surface(struct background_image *image);
+/**
+ * Copies the image unscaled into premultiplied ARGB32 pixel data of the given
+ * size, with its top left corner at (x, y). Parts outside of the destination
+ * are cut off and pixels not covered by the image are left untouched.
+ */
+void background_image_copy_to(struct background_image *image,
+		unsigned char *data, int stride, int width, int height, int x, int y);
 void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 		enum background_mode mode, int buffer_width, int buffer_height);
+/**
+ * Fills an ARGB32 image surface with the color and the image in the given
+ * mode, replacing everything it held before. The surface is split into
+ * horizontal bands which are rendered in parallel on the thread pool, with
+ * the same result as render_background_image.
+ */
+bool render_background_image_banded(cairo_surface_t *target,
+		cairo_surface_t *image, enum background_mode mode, uint32_t color,
+		struct thread_pool *pool);
+/**
+ * Blends two images of 32-bit pixels into dst with blend_row, in the same
+ * bands as render_background_image_banded. All three share the same size
+ * and stride.
+ */
+bool blend_images_banded(void *dst, const void *a, const void *b,
+		int width, int height, int stride, unsigned weight,
+		struct thread_pool *pool);
 
 #endif
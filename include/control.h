@@ -0,0 +1,50 @@
+#ifndef _SWAYBG_CONTROL_H
+#define _SWAYBG_CONTROL_H
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <wayland-client.h>
+
+#define CONTROL_MAX_CLIENTS 8
+#define CONTROL_MAX_POLLFDS (1 + CONTROL_MAX_CLIENTS)
+#define CONTROL_MAX_LINE 4096
+
+/**
+ * Handles one command line sent by a client. Returns NULL on success, or a
+ * message describing the error, which is sent back to the client. On success
+ * the handler may set note to something the client should know.
+ */
+typedef const char *(*control_handler_t)(void *data, char *line,
+		const char **note);
+
+/**
+ * A Unix socket that accepts newline separated commands. Each command is
+ * answered with a line reading "ok", "ok: <note>" or "error: <message>".
+ */
+struct control_socket {
+	int fd;
+	char *path;
+	struct wl_list clients;  // struct control_client::link
+	size_t num_clients;
+	control_handler_t handler;
+	void *data;
+};
+
+bool control_socket_init(struct control_socket *control, const char *path,
+		control_handler_t handler, void *data);
+void control_socket_finish(struct control_socket *control);
+
+/**
+ * Fills in the file descriptors to poll, at most CONTROL_MAX_POLLFDS, and
+ * returns their number.
+ */
+size_t control_socket_get_pollfds(struct control_socket *control,
+		struct pollfd *fds);
+/**
+ * Accepts clients and runs their commands, given the fds filled in by
+ * control_socket_get_pollfds after poll has returned.
+ */
+void control_socket_dispatch(struct control_socket *control,
+		const struct pollfd *fds, size_t num_fds);
+
+#endif
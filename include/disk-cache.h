@@ -0,0 +1,70 @@
+#ifndef _SWAYBG_DISK_CACHE_H
+#define _SWAYBG_DISK_CACHE_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include "background-image.h"
+
+/**
+ * Rendered frames stored under $XDG_CACHE_HOME/swaybg, so that a background
+ * shown before can be displayed again without decoding and scaling its image.
+ * Once the cache grows past its size limit, the least recently used frames
+ * are deleted.
+ */
+struct disk_cache {
+	char *dir;  // NULL if the cache is disabled
+	uint64_t max_size;
+};
+
+/**
+ * Everything that goes into a frame. The modification time and size of the
+ * image file are part of it, so an edited image is never served stale. They
+ * must be those of the file the frame was made from, not of the file as it
+ * is now.
+ */
+struct disk_cache_key {
+	const char *path;
+	struct timespec mtime;
+	off_t file_size;  // -1 if unknown, in which case nothing is cached
+	enum background_mode mode;
+	uint32_t color;
+	int width, height;
+	bool rgb565;  // Whether the frame may be stored as RGB565
+};
+
+/**
+ * An entry found in the cache. The pixel data starts at a page aligned
+ * offset into the file, so it can be read or mapped as-is.
+ */
+struct disk_cache_entry {
+	int fd;
+	uint32_t format;  // enum wl_shm_format
+	int stride;
+	off_t data_offset;
+};
+
+void disk_cache_init(struct disk_cache *cache, uint64_t max_size);
+void disk_cache_finish(struct disk_cache *cache);
+
+/**
+ * Looks up the frame for the given key. On success the entry must be closed
+ * with disk_cache_close.
+ */
+bool disk_cache_open(struct disk_cache *cache, const struct disk_cache_key *key,
+		struct disk_cache_entry *entry);
+/**
+ * Reads the pixels of an entry into data, which must use the entry's stride.
+ */
+bool disk_cache_read(struct disk_cache_entry *entry, void *data, int height);
+void disk_cache_close(struct disk_cache_entry *entry);
+
+/**
+ * Stores a frame, replacing any previous frame for the same key, and evicts
+ * old frames if the cache has grown too large. This blocks on disk I/O, but
+ * is safe to call from any thread.
+ */
+void disk_cache_store(struct disk_cache *cache, const struct disk_cache_key *key,
+		uint32_t format, const void *data, int stride);
+
+#endif
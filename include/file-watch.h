@@ -0,0 +1,41 @@
+#ifndef _SWAYBG_FILE_WATCH_H
+#define _SWAYBG_FILE_WATCH_H
+#include <stdbool.h>
+#include <wayland-client.h>
+
+/**
+ * Called with the path of a watched file after it has been rewritten, in the
+ * same form it was passed to file_watcher_add.
+ */
+typedef void (*file_watch_handler_t)(void *data, const char *path);
+
+/**
+ * Notices when files are rewritten, either in place or by renaming a new file
+ * over them. This watches the directories the files are in, so that replaced
+ * files are still seen. Without inotify, nothing is ever reported.
+ */
+struct file_watcher {
+	int fd;
+	struct wl_list dirs;  // struct watched_dir::link
+	file_watch_handler_t handler;
+	void *data;
+};
+
+void file_watcher_init(struct file_watcher *watcher,
+		file_watch_handler_t handler, void *data);
+void file_watcher_finish(struct file_watcher *watcher);
+
+void file_watcher_add(struct file_watcher *watcher, const char *path);
+/**
+ * Stops watching a file, and its directory once no other file in it is
+ * watched. The path must be given in the same form as to file_watcher_add.
+ */
+void file_watcher_remove(struct file_watcher *watcher, const char *path);
+
+/**
+ * Returns the fd to poll for readability, or -1 if files are not watched.
+ */
+int file_watcher_get_fd(struct file_watcher *watcher);
+void file_watcher_dispatch(struct file_watcher *watcher);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef _SWAYBG_FRAME_CACHE_H
+#define _SWAYBG_FRAME_CACHE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <wayland-client.h>
+#include "background-image.h"
+
+/**
+ * A fully rendered background (color and scaled image) for one buffer size,
+ * scaled ahead of time, such as for the next slide of a slideshow. Entries
+ * are keyed by everything that goes into the frame, and are handed over to
+ * the buffer that shows them, so that no frame is kept twice.
+ */
+struct frame_cache_entry {
+	cairo_surface_t *image;
+	enum background_mode mode;
+	uint32_t color;
+	int width, height;
+
+	cairo_surface_t *frame;
+	struct wl_list link; // struct frame_cache::entries
+};
+
+struct frame_cache {
+	struct wl_list entries; // most recently added first
+	size_t max_entries;
+};
+
+void frame_cache_init(struct frame_cache *cache, size_t max_entries);
+void frame_cache_finish(struct frame_cache *cache);
+
+/**
+ * Removes the frame for the given parameters from the cache and returns it,
+ * or returns NULL if there is none. The caller owns the returned surface.
+ */
+cairo_surface_t *frame_cache_take(struct frame_cache *cache,
+		cairo_surface_t *image, enum background_mode mode, uint32_t color,
+		int width, int height);
+/**
+ * Adds a frame rendered elsewhere, taking ownership of it.
+ */
+void frame_cache_insert(struct frame_cache *cache,
+		cairo_surface_t *image, enum background_mode mode, uint32_t color,
+		int width, int height, cairo_surface_t *frame);
+/**
+ * Drops all frames rendered from the given image. Must be called before the
+ * image is destroyed.
+ */
+void frame_cache_invalidate(struct frame_cache *cache, cairo_surface_t *image);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef _SWAYBG_PIXEL_CONVERT_H
+#define _SWAYBG_PIXEL_CONVERT_H
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Converts a row of packed 8-bit RGB pixels to native endian XRGB32, as used
+ * by CAIRO_FORMAT_RGB24. The unused byte is set to 0xFF, so the result is
+ * also a valid opaque ARGB32 row.
+ */
+void convert_rgb_row(uint8_t *dst, const uint8_t *src, int width);
+
+/**
+ * Converts a row of 8-bit RGBA pixels with straight alpha to native endian
+ * premultiplied ARGB32, rounding each channel like lround(c * a / 255.0).
+ */
+void premultiply_rgba_row(uint8_t *dst, const uint8_t *src, int width);
+
+/**
+ * Blends two rows of 32-bit pixels channel by channel, giving b a weight of
+ * weight/256 and a the rest. The format is irrelevant as long as both rows
+ * use the same one.
+ */
+void blend_row(uint8_t *dst, const uint8_t *a, const uint8_t *b, int width,
+		unsigned weight);
+
+/**
+ * Scalar versions of the above. The vectorized kernels picked at runtime
+ * must produce exactly the same bytes.
+ */
+void convert_rgb_row_scalar(uint8_t *dst, const uint8_t *src, int width);
+void premultiply_rgba_row_scalar(uint8_t *dst, const uint8_t *src, int width);
+void blend_row_scalar(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+		int width, unsigned weight);
+
+/**
+ * A set of implementations of the above, all using the same instructions.
+ */
+struct pixel_kernels {
+	const char *name;
+	void (*convert_rgb_row)(uint8_t *dst, const uint8_t *src, int width);
+	void (*premultiply_rgba_row)(uint8_t *dst, const uint8_t *src,
+		int width);
+	void (*blend_row)(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+		int width, unsigned weight);
+};
+
+/**
+ * Returns every kernel set this CPU can run, best first. The first one is
+ * used by the functions above and the last one is the scalar set.
+ */
+const struct pixel_kernels *const *get_pixel_kernels(size_t *count);
+
+#endif
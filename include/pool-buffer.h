@@ -5,18 +5,42 @@
 #include <stdint.h>
 #include <wayland-client.h>
 
+/**
+ * A single shared memory file, and wl_shm_pool, that all buffers are carved
+ * out of. It grows as needed; freed ranges are reused by later buffers.
+ */
+struct shm_arena {
+	struct wl_shm *shm;
+	struct wl_shm_pool *pool;
+	int fd;
+	size_t size, page_size;
+	struct wl_list free;  // struct shm_extent::link, sorted by offset
+};
+
 struct pool_buffer {
+	struct shm_arena *arena;
+	size_t offset;
 	struct wl_buffer *buffer;
 	cairo_surface_t *surface;
 	cairo_t *cairo;
 	uint32_t width, height;
+	uint32_t format;  // enum wl_shm_format
+	int stride;
 	void *data;
 	size_t size;
 	bool busy;
 };
 
-struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-		struct pool_buffer pool[static 2], uint32_t width, uint32_t height);
+bool shm_arena_init(struct shm_arena *arena, struct wl_shm *shm);
+void shm_arena_finish(struct shm_arena *arena);
+
+/**
+ * Carves a buffer out of the arena. Its pixels are all zero, even if an
+ * earlier buffer used the same range.
+ */
+struct pool_buffer *create_buffer(struct shm_arena *arena,
+		struct pool_buffer *buf, int32_t width, int32_t height,
+		uint32_t format);
 void destroy_buffer(struct pool_buffer *buffer);
 
 #endif
@@ -0,0 +1,60 @@
+#ifndef _SWAYBG_THREAD_POOL_H
+#define _SWAYBG_THREAD_POOL_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <wayland-client.h>
+
+enum thread_pool_task_state {
+	THREAD_POOL_TASK_QUEUED,
+	THREAD_POOL_TASK_RUNNING,
+	THREAD_POOL_TASK_DONE,
+};
+
+/**
+ * A unit of work, usually embedded in the structure it operates on. The task
+ * must stay alive until thread_pool_wait has returned for it.
+ */
+struct thread_pool_task {
+	void (*run)(struct thread_pool_task *task);
+	enum thread_pool_task_state state;
+	struct wl_list link;  // struct thread_pool::queue
+};
+
+struct thread_pool;
+
+/**
+ * Creates a pool with the given number of worker threads, or one per online
+ * CPU if num_threads is 0.
+ */
+struct thread_pool *thread_pool_create(size_t num_threads);
+void thread_pool_destroy(struct thread_pool *pool);
+
+size_t thread_pool_get_num_threads(struct thread_pool *pool);
+
+/**
+ * Queues the task to run on a worker thread. If the pool has no threads, the
+ * task runs before this function returns.
+ */
+void thread_pool_submit(struct thread_pool *pool,
+		struct thread_pool_task *task,
+		void (*run)(struct thread_pool_task *task));
+/**
+ * Blocks until the task has finished. A task that no worker has picked up
+ * yet is run on the calling thread instead.
+ */
+void thread_pool_wait(struct thread_pool *pool, struct thread_pool_task *task);
+/**
+ * Takes the task off the queue if no worker has picked it up yet, and
+ * otherwise waits for it to finish. Returns whether it was taken off the
+ * queue, in which case it never runs.
+ */
+bool thread_pool_cancel(struct thread_pool *pool,
+		struct thread_pool_task *task);
+/**
+ * Returns whether the task has finished, without blocking. Once it has,
+ * thread_pool_wait returns at once.
+ */
+bool thread_pool_is_done(struct thread_pool *pool,
+		struct thread_pool_task *task);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _SWAYBG_TRACE_H
+#define _SWAYBG_TRACE_H
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Startup tracing, enabled by setting SWAYBG_TRACE to the path of a file.
+ * Events are kept in memory until trace_finish writes them as Chrome
+ * trace-event JSON, which chrome://tracing and Perfetto can show. All
+ * functions are safe to call from any thread, and cheap while tracing is
+ * off.
+ */
+void trace_init(void);
+bool trace_is_enabled(void);
+
+/**
+ * Returns the start time of a span, to be passed to trace_end.
+ */
+int64_t trace_begin(void);
+/**
+ * Records a span from start until now. The detail, if any, is copied.
+ */
+void trace_end(int64_t start, const char *name, const char *detail);
+void trace_instant(const char *name, const char *detail);
+
+/**
+ * Writes the trace, logs a summary and stops tracing.
+ */
+void trace_finish(void);
+
+#endif
@@ -1,20 +1,47 @@
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <wayland-client.h>
+#include "animation-ring.h"
 #include "background-image.h"
 #include "cairo.h"
+#include "control.h"
+#include "disk-cache.h"
+#include "file-watch.h"
+#include "fractional-scale-v1-client-protocol.h"
+#include "frame-cache.h"
 #include "log.h"
+#include "pixel-convert.h"
 #include "pool-buffer.h"
+#include "single-pixel-buffer-v1-client-protocol.h"
+#include "thread-pool.h"
+#include "trace.h"
+#include "viewporter-client-protocol.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-client-protocol.h"
 
+// Enough to hold the next slide for a few outputs
+#define FRAME_CACHE_MAX_ENTRIES 4
+#define DISK_CACHE_MAX_SIZE (256 * 1024 * 1024)
+#define PREFETCH_MAX_FRAMES 4
+// Memory for the scaled frames of an animation on one output
+#define ANIMATION_CACHE_SIZE (128 * 1024 * 1024)
+#define ANIMATION_MAX_SLOTS 64
+
 static uint32_t parse_color(const char *color) {
 	if (color[0] == '#') {
 		++color;
@@ -39,19 +66,180 @@ struct swaybg_state {
 	struct wl_shm *shm;
 	struct zwlr_layer_shell_v1 *layer_shell;
 	struct zxdg_output_manager_v1 *xdg_output_manager;
+	struct wp_viewporter *viewporter;
+	struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager;
+	struct wp_fractional_scale_manager_v1 *fractional_scale_manager;
 	struct wl_list configs;  // struct swaybg_output_config::link
+	struct wl_list images;  // struct swaybg_image::link
 	struct wl_list outputs;  // struct swaybg_output::link
+	struct wl_list dropped_outputs;  // struct swaybg_dropped_output::link
+	struct wl_list buffers;  // struct swaybg_buffer::link
+	struct wl_list cache_stores;  // struct swaybg_cache_store::link
+	struct shm_arena shm_arena;
+	struct frame_cache frame_cache;
+	struct disk_cache disk_cache;
+	struct thread_pool *thread_pool;
+	struct control_socket control;
+	char *control_path;
+	struct file_watcher file_watcher;
+	bool compositor_scaling;
+	bool rgb565, shm_has_rgb565;
+	int fade_duration;  // In milliseconds, 0 to switch frames at once
 	bool run_display;
+	unsigned int skipped_renders;
+};
+
+/**
+ * Images are only decoded once an output that uses them shows up, and are
+ * freed again when the last such output goes away. Decoding runs on the
+ * thread pool, so several images can be loaded at the same time.
+ *
+ * Images are decoded at the smallest scale that still has all the detail
+ * their outputs can show, and decoded again if a larger output comes along.
+ * Until the outputs are known, the file is only probed for its size.
+ */
+struct swaybg_image {
+	char *path;
+	int width, height;  // size of the file, or 0 if unknown
+	// Of the file when its size was read, which cached frames are looked up
+	// by; file_size is -1 if unknown
+	struct timespec mtime;
+	off_t file_size;
+	bool size_read;
+	bool probing;
+	bool readahead;  // Whether the probe also has the file read from disk
+	struct thread_pool_task probe_task;
+	struct background_image *decoded;  // Only set while not loading
+	double scale;  // of the decoded image or the one being decoded
+	bool loading, load_failed;
+	struct thread_pool_task load_task;
+	// Written by the load task, and moved to decoded by wait_for_image
+	struct background_image *loaded;
+	struct wl_list link;  // struct swaybg_state::images
+};
+
+/**
+ * The next slide of a slideshow, decoded and scaled to the sizes of its
+ * outputs on the thread pool while the current slide is shown.
+ */
+struct swaybg_prefetch {
+	struct thread_pool_task task;
+	struct thread_pool *pool;
+	struct swaybg_image *image;
+	enum background_mode mode;
+	uint32_t color;
+	double scale;
+
+	// Set by the task, unless the image was already decoded
+	struct background_image *decoded;
+	cairo_surface_t *surface;  // A reference of its own
+	struct {
+		int width, height;
+		cairo_surface_t *frame;
+	} frames[PREFETCH_MAX_FRAMES];
+	size_t num_frames;
 };
 
 struct swaybg_output_config {
 	char *output;
-	cairo_surface_t *image;
+	struct swaybg_image *image;
 	enum background_mode mode;
 	uint32_t color;
+
+	// A slideshow shows each slide for interval seconds, starting over after
+	// the last one
+	struct swaybg_image **slides;
+	size_t num_slides, slide;
+	int interval;
+	struct timespec next_slide;
+	struct swaybg_prefetch *prefetch;
+
 	struct wl_list link;
 };
 
+/**
+ * The background never changes once rendered, so outputs showing the same
+ * config at the same buffer size can all attach a single buffer. A buffer
+ * nobody references any more is kept until the compositor releases it.
+ */
+struct swaybg_buffer {
+	struct swaybg_output_config *config;
+	struct pool_buffer buffer;
+	int refs;
+	bool cached;  // Whether the frame is in the disk cache
+	struct wl_list link;  // struct swaybg_state::buffers
+};
+
+/**
+ * A frame being written to the disk cache on the thread pool. The buffer is
+ * kept alive until the write is done.
+ */
+struct swaybg_cache_store {
+	struct thread_pool_task task;
+	struct disk_cache *cache;
+	struct disk_cache_key key;
+	char *path;  // of the image, which may go away in the meantime
+	struct swaybg_buffer *buffer;
+	struct wl_list link;  // struct swaybg_state::cache_stores
+};
+
+/**
+ * Everything the contents of an output's surface depend on. Committing the
+ * same contents again would only make the compositor upload them again.
+ */
+struct swaybg_content {
+	struct swaybg_output_config *config;
+	struct swaybg_image *source;
+	struct background_image *image;
+	enum background_mode mode;
+	uint32_t color;
+	uint32_t width, height;
+	uint32_t scale;  // In 120ths
+};
+
+/**
+ * An animated image playing on an output. Each frame is scaled on the thread
+ * pool while the one before it is shown, into a slot picked by the ring, so
+ * an animation with no more frames than it has slots is only ever scaled
+ * once.
+ */
+struct swaybg_animation {
+	struct background_frame *frames;  // Referenced from the image
+	size_t num_frames;
+	size_t frame;  // The one on screen
+	struct swaybg_buffer *shown;  // Holding the frame on screen
+	int64_t next_frame;  // In milliseconds, INT64_MAX once it has stopped
+	// Copied from the config, for the task to read off the main thread
+	enum background_mode mode;
+	uint32_t color;
+	struct thread_pool *pool;
+
+	struct swaybg_animation_slot {
+		struct thread_pool_task task;
+		bool scaling;  // Until the task has been waited for
+		struct swaybg_animation *animation;
+		struct swaybg_buffer *buffer;
+		size_t frame;  // Scaled, or being scaled, into the buffer, or SIZE_MAX
+		// The region in which the frame differs from frame damage_base,
+		// which base holds
+		size_t damage_base;
+		const struct pool_buffer *base;
+		int32_t damage_x, damage_y, damage_width, damage_height;
+	} slots[ANIMATION_MAX_SLOTS];
+	struct animation_ring ring;
+};
+
+/**
+ * An output that had no config when it showed up, and was let go of. It only
+ * gets a background if it shows up again.
+ */
+struct swaybg_dropped_output {
+	uint32_t wl_name;
+	char *name;
+	char *identifier;
+	struct wl_list link;  // struct swaybg_state::dropped_outputs
+};
+
 struct swaybg_output {
 	uint32_t wl_name;
 	struct wl_output *wl_output;
@@ -64,15 +252,46 @@ struct swaybg_output {
 
 	struct wl_surface *surface;
 	struct zwlr_layer_surface_v1 *layer_surface;
-	struct pool_buffer buffers[2];
-	struct pool_buffer *current_buffer;
+	struct wp_viewport *viewport;
+	struct wp_fractional_scale_v1 *fractional_scale;
+	struct swaybg_buffer *buffer;
 
 	uint32_t width, height;
 	int32_t scale;
+	uint32_t preferred_scale;  // In 120ths, 0 until the compositor sends it
+	int32_t logical_width, logical_height;
+
+	uint32_t configure_serial;
+	bool needs_ack;
+	bool dirty;
+	struct swaybg_content committed;
+
+	// While fading, the surface shows a blend of fade_from and buffer,
+	// written to one of the fade buffers on every frame callback. Each step
+	// is blended from the one before it, so fade_from is only read by the
+	// first step, and may then serve as the second fade buffer.
+	struct swaybg_buffer *fade_from;
+	struct swaybg_buffer *fade_buffers[2];
+	struct swaybg_buffer *fade_shown;  // The fade buffer last committed
+	unsigned fade_weight;  // Of buffer in fade_shown, out of 256
+	int64_t fade_start;  // In milliseconds
+	struct swaybg_animation *animation;
+
+	// Fades and animations only move on once the previous frame is shown
+	struct wl_callback *frame_callback;
+	bool frame_ready;
 
 	struct wl_list link;
 };
 
+static void get_time(struct timespec *ts) {
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static int64_t timespec_to_msec(const struct timespec *ts) {
+	return (int64_t)ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+}
+
 bool is_valid_color(const char *color) {
 	int len = strlen(color);
 	if (len != 7 || color[0] != '#') {
@@ -91,35 +310,1167 @@ bool is_valid_color(const char *color) {
 	return true;
 }
 
-static void render_frame(struct swaybg_output *output) {
-	int buffer_width = output->width * output->scale,
-		buffer_height = output->height * output->scale;
-	output->current_buffer = get_next_buffer(output->state->shm,
-			output->buffers, buffer_width, buffer_height);
-	if (!output->current_buffer) {
+static void wait_for_image(struct swaybg_state *state,
+		struct swaybg_image *image) {
+	if (!image->loading) {
+		return;
+	}
+	thread_pool_wait(state->thread_pool, &image->load_task);
+	image->loading = false;
+	image->decoded = image->loaded;
+	image->loaded = NULL;
+	if (!image->decoded) {
+		swaybg_log(LOG_ERROR, "Failed to load image: %s", image->path);
+		image->load_failed = true;
+	}
+}
+
+static void load_image_task(struct thread_pool_task *task) {
+	struct swaybg_image *image = wl_container_of(task, image, load_task);
+	int64_t start = trace_begin();
+	image->loaded = load_background_image(image->path, image->scale);
+	trace_end(start, "decode", image->path);
+}
+
+static void unload_image(struct swaybg_state *state,
+		struct swaybg_image *image) {
+	wait_for_image(state, image);
+	if (!image->decoded) {
 		return;
 	}
-	cairo_t *cairo = output->current_buffer->cairo;
+	if (image->decoded->surface) {
+		frame_cache_invalidate(&state->frame_cache, image->decoded->surface);
+	}
+	destroy_background_image(image->decoded);
+	image->decoded = NULL;
+}
+
+/**
+ * Starts decoding the image at the given scale, unless it is already
+ * decoded, or being decoded, at that scale or larger. The result is picked
+ * up by wait_for_image.
+ */
+static void load_image(struct swaybg_state *state, struct swaybg_image *image,
+		double scale) {
+	if (image->load_failed ||
+			((image->loading || image->decoded) && image->scale >= scale)) {
+		return;
+	}
+	if (image->loading || image->decoded) {
+		swaybg_log(LOG_DEBUG, "Reloading image %s at a larger size",
+				image->path);
+		unload_image(state, image);
+		if (image->load_failed) {
+			return;
+		}
+	}
+	swaybg_log(LOG_DEBUG, "Loading image %s at %.0f%% scale",
+			image->path, scale * 100);
+	image->scale = scale;
+	image->loading = true;
+	thread_pool_submit(state->thread_pool, &image->load_task,
+			load_image_task);
+}
+
+static void read_image_info(struct swaybg_image *image) {
+	struct stat st;
+	if (stat(image->path, &st) == 0) {
+		image->mtime = st.st_mtim;
+		image->file_size = st.st_size;
+	} else {
+		image->file_size = -1;
+	}
+	if (!read_background_image_size(image->path,
+				&image->width, &image->height)) {
+		image->width = image->height = 0;
+	}
+	image->size_read = true;
+}
+
+static void probe_image_task(struct thread_pool_task *task) {
+	struct swaybg_image *image = wl_container_of(task, image, probe_task);
+	int64_t start = trace_begin();
+	int fd = image->readahead ? open(image->path, O_RDONLY | O_CLOEXEC) : -1;
+	if (fd >= 0) {
+		// Have the file read from disk in the background, so that decoding
+		// it later does not have to wait for it
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+	read_image_info(image);
+	trace_end(start, "probe", image->path);
+}
+
+/**
+ * Reads the size of the image on the thread pool, while we connect to the
+ * compositor and learn the sizes of the outputs. With readahead, the whole
+ * file is read from disk in the background as well.
+ */
+static void probe_image(struct swaybg_state *state,
+		struct swaybg_image *image, bool readahead) {
+	if (!image || image->probing || image->size_read) {
+		return;
+	}
+	image->probing = true;
+	image->readahead = readahead;
+	thread_pool_submit(state->thread_pool, &image->probe_task,
+			probe_image_task);
+}
+
+static void wait_for_probe(struct swaybg_state *state,
+		struct swaybg_image *image) {
+	if (!image->probing) {
+		return;
+	}
+	thread_pool_wait(state->thread_pool, &image->probe_task);
+	image->probing = false;
+}
+
+/**
+ * Makes sure the size of the image and the state of its file are known,
+ * reading them now if the image was not probed.
+ */
+static void get_image_info(struct swaybg_state *state,
+		struct swaybg_image *image) {
+	wait_for_probe(state, image);
+	if (!image->size_read) {
+		read_image_info(image);
+	}
+}
+
+static double get_image_scale(struct swaybg_state *state,
+		struct swaybg_image *image, enum background_mode mode,
+		int buffer_width, int buffer_height) {
+	get_image_info(state, image);
+	if (image->width <= 0 || image->height <= 0 ||
+			buffer_width <= 0 || buffer_height <= 0) {
+		return 1.0;
+	}
+	return get_background_image_scale(image->width, image->height, mode,
+			buffer_width, buffer_height);
+}
+
+/**
+ * Returns the decoded image for a buffer of the given size, decoding it
+ * first if it is not available at a large enough size yet.
+ */
+static struct background_image *get_config_image(struct swaybg_state *state,
+		struct swaybg_output_config *config,
+		int buffer_width, int buffer_height) {
+	// Outputs whose image failed to load show just the background color
+	if (config->mode == BACKGROUND_MODE_SOLID_COLOR || !config->image) {
+		return NULL;
+	}
+	load_image(state, config->image, get_image_scale(state, config->image,
+				config->mode, buffer_width, buffer_height));
+	wait_for_image(state, config->image);
+	return config->image->decoded;
+}
+
+/**
+ * Checks whether the image ends up in the buffer unscaled and at a whole
+ * pixel offset, so it can be copied over as-is, and returns that offset.
+ */
+static bool can_copy_image(struct swaybg_output_config *config,
+		struct background_image *image, struct pool_buffer *buffer,
+		int *x, int *y) {
+	if (config->color && !image->opaque) {
+		// The image needs to be blended over the color
+		return false;
+	}
+	if ((int)buffer->width == image->width &&
+			(int)buffer->height == image->height) {
+		// Every mode draws the image as-is at its own size
+		*x = *y = 0;
+		return true;
+	}
+	// Center mode draws at a half pixel offset if the sizes differ in parity
+	if (config->mode == BACKGROUND_MODE_CENTER &&
+			((int)buffer->width - image->width) % 2 == 0 &&
+			((int)buffer->height - image->height) % 2 == 0) {
+		*x = ((int)buffer->width - image->width) / 2;
+		*y = ((int)buffer->height - image->height) / 2;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Fills the whole buffer with the color, replacing whatever an earlier
+ * buffer in the same part of the arena left there.
+ */
+static void paint_color(cairo_t *cairo, uint32_t color) {
 	cairo_save(cairo);
-	cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_u32(cairo, color);
 	cairo_paint(cairo);
 	cairo_restore(cairo);
-	if (output->config->mode == BACKGROUND_MODE_SOLID_COLOR) {
-		cairo_set_source_u32(cairo, output->config->color);
+}
+
+static void render_buffer(struct swaybg_state *state,
+		struct swaybg_output_config *config, struct background_image *image,
+		struct pool_buffer *buffer) {
+	cairo_t *cairo = buffer->cairo;
+	cairo_surface_t *surface = NULL, *frame;
+	int x, y;
+	if (!image) {
+		paint_color(cairo, config->color);
+	} else if (buffer->format != WL_SHM_FORMAT_RGB565 &&
+			can_copy_image(config, image, buffer, &x, &y)) {
+		// Write the pixels straight into the buffer, skipping cairo
+		if ((int)buffer->width != image->width ||
+				(int)buffer->height != image->height) {
+			paint_color(cairo, config->color);
+		}
+		cairo_surface_flush(buffer->surface);
+		background_image_copy_to(image, buffer->data, buffer->stride,
+				buffer->width, buffer->height, x, y);
+		cairo_surface_mark_dirty(buffer->surface);
+	} else if (!(surface = background_image_get_surface(image))) {
+		paint_color(cairo, config->color);
+	} else if ((frame = frame_cache_take(&state->frame_cache, surface,
+					config->mode, config->color,
+					buffer->width, buffer->height))) {
+		// Scaled ahead of time. The buffer holds the only copy from now on,
+		// and is shared by every output that shows it.
+		cairo_save(cairo);
+		cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_surface(cairo, frame, 0, 0);
 		cairo_paint(cairo);
+		cairo_restore(cairo);
+		cairo_surface_destroy(frame);
 	} else {
-		if (output->config->color) {
-			cairo_set_source_u32(cairo, output->config->color);
-			cairo_paint(cairo);
+		render_background_image_banded(buffer->surface, surface,
+				config->mode, config->color, state->thread_pool);
+	}
+}
+
+/**
+ * Whether every pixel of the frame for this config will be fully opaque.
+ */
+static bool is_frame_opaque(struct swaybg_output_config *config,
+		struct background_image *image) {
+	if ((config->color & 0xFF) == 0xFF) {
+		// The color is painted under the image
+		return true;
+	}
+	if (!image || !image->opaque) {
+		return false;
+	}
+	return config->mode == BACKGROUND_MODE_STRETCH ||
+		config->mode == BACKGROUND_MODE_FILL ||
+		config->mode == BACKGROUND_MODE_TILE;
+}
+
+static uint32_t get_buffer_format(struct swaybg_state *state,
+		struct swaybg_output_config *config, struct background_image *image) {
+	if (!is_frame_opaque(config, image)) {
+		return WL_SHM_FORMAT_ARGB8888;
+	}
+	// Without alpha the compositor does not need to blend the surface
+	if (state->rgb565 && state->shm_has_rgb565) {
+		return WL_SHM_FORMAT_RGB565;
+	}
+	return WL_SHM_FORMAT_XRGB8888;
+}
+
+/**
+ * Buffers are matched by config, so this must be called whenever the
+ * contents of a config change.
+ */
+static void invalidate_config_buffers(struct swaybg_state *state,
+		struct swaybg_output_config *config) {
+	struct swaybg_buffer *buffer;
+	wl_list_for_each(buffer, &state->buffers, link) {
+		if (buffer->config == config) {
+			buffer->config = NULL;
+		}
+	}
+}
+
+static void destroy_shared_buffer(struct swaybg_buffer *buffer) {
+	wl_list_remove(&buffer->link);
+	destroy_buffer(&buffer->buffer);
+	free(buffer);
+}
+
+static struct swaybg_buffer *find_shared_buffer(struct swaybg_state *state,
+		struct swaybg_output_config *config, uint32_t width, uint32_t height,
+		uint32_t format) {
+	struct swaybg_buffer *buffer;
+	wl_list_for_each(buffer, &state->buffers, link) {
+		if (buffer->config == config && buffer->buffer.width == width &&
+				buffer->buffer.height == height &&
+				buffer->buffer.format == format) {
+			buffer->refs++;
+			return buffer;
+		}
+	}
+	return NULL;
+}
+
+static struct swaybg_buffer *create_shared_buffer(struct swaybg_state *state,
+		struct swaybg_output_config *config, uint32_t width, uint32_t height,
+		uint32_t format) {
+	struct swaybg_buffer *buffer = calloc(1, sizeof(struct swaybg_buffer));
+	if (!buffer) {
+		swaybg_log(LOG_ERROR, "Failed to allocate buffer");
+		return NULL;
+	}
+	if (!create_buffer(&state->shm_arena, &buffer->buffer, width, height,
+				format)) {
+		free(buffer);
+		return NULL;
+	}
+	buffer->config = config;
+	buffer->refs = 1;
+	wl_list_insert(&state->buffers, &buffer->link);
+	return buffer;
+}
+
+static struct swaybg_buffer *get_shared_buffer(struct swaybg_state *state,
+		struct swaybg_output_config *config, struct background_image *image,
+		uint32_t width, uint32_t height) {
+	uint32_t format = get_buffer_format(state, config, image);
+	struct swaybg_buffer *buffer =
+		find_shared_buffer(state, config, width, height, format);
+	if (buffer) {
+		return buffer;
+	}
+	buffer = create_shared_buffer(state, config, width, height, format);
+	if (buffer) {
+		render_buffer(state, config, image, &buffer->buffer);
+	}
+	return buffer;
+}
+
+/**
+ * Builds the key to look up the frame for the config by. The file is taken
+ * to be as it was when the image was probed.
+ */
+static void get_disk_cache_key(struct swaybg_state *state,
+		struct swaybg_output_config *config, int width, int height,
+		struct disk_cache_key *key) {
+	get_image_info(state, config->image);
+	*key = (struct disk_cache_key){
+		.path = config->image->path,
+		.mtime = config->image->mtime,
+		.file_size = config->image->file_size,
+		.mode = config->mode,
+		.color = config->color,
+		.width = width,
+		.height = height,
+		.rgb565 = state->rgb565 && state->shm_has_rgb565,
+	};
+}
+
+static bool has_cached_frame(struct swaybg_state *state,
+		struct swaybg_output_config *config, int width, int height) {
+	struct disk_cache_key key;
+	get_disk_cache_key(state, config, width, height, &key);
+	struct disk_cache_entry entry;
+	if (!disk_cache_open(&state->disk_cache, &key, &entry)) {
+		return false;
+	}
+	disk_cache_close(&entry);
+	return true;
+}
+
+/**
+ * Gets a buffer with the frame for the config from the disk cache, without
+ * decoding its image.
+ */
+static struct swaybg_buffer *get_cached_buffer(struct swaybg_state *state,
+		struct swaybg_output_config *config, int width, int height) {
+	struct disk_cache_key key;
+	get_disk_cache_key(state, config, width, height, &key);
+	struct disk_cache_entry entry;
+	if (!disk_cache_open(&state->disk_cache, &key, &entry)) {
+		return NULL;
+	}
+	struct swaybg_buffer *buffer =
+		find_shared_buffer(state, config, width, height, entry.format);
+	if (!buffer) {
+		buffer = create_shared_buffer(state, config, width, height,
+				entry.format);
+		if (buffer && (buffer->buffer.stride != entry.stride ||
+					!disk_cache_read(&entry, buffer->buffer.data, height))) {
+			swaybg_log(LOG_INFO, "Failed to read cached frame for %s",
+					key.path);
+			destroy_shared_buffer(buffer);
+			buffer = NULL;
+		} else if (buffer) {
+			buffer->cached = true;
+		}
+	}
+	disk_cache_close(&entry);
+	return buffer;
+}
+
+static void unref_shared_buffer(struct swaybg_buffer *buffer) {
+	if (!buffer || --buffer->refs > 0) {
+		return;
+	}
+	// The compositor may still be reading from the buffer, and its memory
+	// would be handed straight to the next one; see release_unused_buffers
+	if (!buffer->buffer.busy) {
+		destroy_shared_buffer(buffer);
+	}
+}
+
+static void store_cached_frame_task(struct thread_pool_task *task) {
+	struct swaybg_cache_store *store = wl_container_of(task, store, task);
+	struct pool_buffer *buffer = &store->buffer->buffer;
+	disk_cache_store(store->cache, &store->key, buffer->format, buffer->data,
+			buffer->stride);
+}
+
+/**
+ * Writes the frame in the buffer, rendered from the image, to the disk cache
+ * on the thread pool.
+ */
+static void store_cached_frame(struct swaybg_state *state,
+		struct swaybg_output_config *config, struct background_image *image,
+		struct swaybg_buffer *buffer) {
+	if (!state->disk_cache.dir || image->file_size < 0) {
+		return;
+	}
+	struct swaybg_cache_store *store =
+		calloc(1, sizeof(struct swaybg_cache_store));
+	char *path = strdup(config->image->path);
+	if (!store || !path) {
+		swaybg_log(LOG_ERROR, "Failed to allocate cache store");
+		free(store);
+		free(path);
+		return;
+	}
+	get_disk_cache_key(state, config, buffer->buffer.width,
+			buffer->buffer.height, &store->key);
+	store->key.path = store->path = path;
+	// The frame shows the file as it was decoded, not as it was probed
+	store->key.mtime = image->mtime;
+	store->key.file_size = image->file_size;
+	store->cache = &state->disk_cache;
+	store->buffer = buffer;
+	buffer->refs++;
+	wl_list_insert(&state->cache_stores, &store->link);
+	thread_pool_submit(state->thread_pool, &store->task,
+			store_cached_frame_task);
+}
+
+/**
+ * Lets go of the buffers of finished disk cache writes. With wait set, waits
+ * for all writes to finish first.
+ */
+static void finish_cache_stores(struct swaybg_state *state, bool wait) {
+	struct swaybg_cache_store *store, *tmp;
+	wl_list_for_each_safe(store, tmp, &state->cache_stores, link) {
+		if (!wait && !thread_pool_is_done(state->thread_pool, &store->task)) {
+			continue;
+		}
+		thread_pool_wait(state->thread_pool, &store->task);
+		unref_shared_buffer(store->buffer);
+		wl_list_remove(&store->link);
+		free(store->path);
+		free(store);
+	}
+}
+
+static void release_unused_buffers(struct swaybg_state *state) {
+	struct swaybg_buffer *buffer, *tmp;
+	wl_list_for_each_safe(buffer, tmp, &state->buffers, link) {
+		if (buffer->refs == 0 && !buffer->buffer.busy) {
+			swaybg_log(LOG_DEBUG, "Freeing released %dx%d buffer",
+					buffer->buffer.width, buffer->buffer.height);
+			destroy_shared_buffer(buffer);
 		}
-		render_background_image(cairo, output->config->image,
-				output->config->mode, buffer_width, buffer_height);
 	}
+}
+
+static void frame_done(void *data, struct wl_callback *callback,
+		uint32_t time) {
+	struct swaybg_output *output = data;
+	wl_callback_destroy(callback);
+	output->frame_callback = NULL;
+	output->frame_ready = true;
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_done,
+};
+
+/**
+ * Asks to be told when the contents of the next commit are shown.
+ */
+static void request_frame(struct swaybg_output *output) {
+	if (!output->frame_callback) {
+		output->frame_callback = wl_surface_frame(output->surface);
+		wl_callback_add_listener(output->frame_callback,
+				&frame_listener, output);
+	}
+	output->frame_ready = false;
+}
+
+static void cancel_frame(struct swaybg_output *output) {
+	if (output->frame_callback) {
+		wl_callback_destroy(output->frame_callback);
+		output->frame_callback = NULL;
+	}
+	output->frame_ready = false;
+}
+
+static void stop_fade(struct swaybg_output *output) {
+	unref_shared_buffer(output->fade_from);
+	output->fade_from = NULL;
+	output->fade_shown = NULL;
+	output->fade_weight = 0;
+	for (size_t i = 0; i < 2; ++i) {
+		unref_shared_buffer(output->fade_buffers[i]);
+		output->fade_buffers[i] = NULL;
+	}
+}
+
+static void stop_animation(struct swaybg_output *output) {
+	struct swaybg_animation *animation = output->animation;
+	if (!animation) {
+		return;
+	}
+	for (size_t i = 0; i < animation->ring.num_slots; ++i) {
+		struct swaybg_animation_slot *slot = &animation->slots[i];
+		if (slot->scaling) {
+			// The next frame is not worth finishing
+			thread_pool_cancel(animation->pool, &slot->task);
+		}
+		unref_shared_buffer(slot->buffer);
+	}
+	for (size_t i = 0; i < animation->num_frames; ++i) {
+		cairo_surface_destroy(animation->frames[i].surface);
+	}
+	free(animation->frames);
+	free(animation);
+	output->animation = NULL;
+}
 
-	wl_surface_set_buffer_scale(output->surface, output->scale);
-	wl_surface_attach(output->surface, output->current_buffer->buffer, 0, 0);
+/**
+ * Sets the buffer the output shows, or is fading to. Any fade or animation
+ * in progress is cut short.
+ */
+static void set_output_buffer(struct swaybg_output *output,
+		struct swaybg_buffer *buffer) {
+	cancel_frame(output);
+	stop_fade(output);
+	stop_animation(output);
+	unref_shared_buffer(output->buffer);
+	output->buffer = buffer;
+}
+
+static void attach_buffer(struct swaybg_output *output,
+		struct pool_buffer *buffer) {
+	wl_surface_attach(output->surface, buffer->buffer, 0, 0);
+	// Cleared again by wl_buffer.release
+	buffer->busy = true;
+}
+
+static void set_opaque_region(struct swaybg_output *output, bool opaque) {
+	if (!opaque) {
+		wl_surface_set_opaque_region(output->surface, NULL);
+		return;
+	}
+	struct wl_region *region =
+		wl_compositor_create_region(output->state->compositor);
+	wl_region_add(region, 0, 0, INT32_MAX, INT32_MAX);
+	wl_surface_set_opaque_region(output->surface, region);
+	wl_region_destroy(region);
+}
+
+static void unset_viewport_source(struct wp_viewport *viewport) {
+	wl_fixed_t unset = wl_fixed_from_int(-1);
+	wp_viewport_set_source(viewport, unset, unset, unset, unset);
+}
+
+static bool render_solid_color_frame(struct swaybg_output *output) {
+	struct swaybg_state *state = output->state;
+	struct wl_buffer *single_pixel = NULL;
+	struct swaybg_buffer *buffer = NULL;
+	if (state->single_pixel_buffer_manager) {
+		// Single pixel buffers take premultiplied 32-bit channels
+		uint32_t color = output->config->color;
+		uint64_t a8 = color & 0xFF;
+		uint64_t f = (uint64_t)0xFFFFFFFF * a8 / (0xFF * 0xFF);
+		single_pixel = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+				state->single_pixel_buffer_manager,
+				(color >> 24 & 0xFF) * f, (color >> 16 & 0xFF) * f,
+				(color >> 8 & 0xFF) * f, a8 * 0xFFFFFFFF / 0xFF);
+	} else {
+		buffer = get_shared_buffer(state, output->config, NULL, 1, 1);
+		if (!buffer) {
+			return false;
+		}
+	}
+	set_output_buffer(output, buffer);
+
+	wl_surface_set_buffer_scale(output->surface, 1);
+	unset_viewport_source(output->viewport);
+	wp_viewport_set_destination(output->viewport,
+			output->width, output->height);
+	if (single_pixel) {
+		wl_surface_attach(output->surface, single_pixel, 0, 0);
+	} else {
+		attach_buffer(output, &buffer->buffer);
+	}
 	wl_surface_damage_buffer(output->surface, 0, 0, INT32_MAX, INT32_MAX);
 	wl_surface_commit(output->surface);
+
+	if (single_pixel) {
+		// The compositor keeps the contents; we never touch the buffer again
+		wl_buffer_destroy(single_pixel);
+	}
+	return true;
+}
+
+static bool can_scale_on_compositor(struct swaybg_output *output) {
+	enum background_mode mode = output->config->mode;
+	return output->state->compositor_scaling && output->viewport &&
+		(mode == BACKGROUND_MODE_STRETCH || mode == BACKGROUND_MODE_FILL);
+}
+
+static bool render_native_size_frame(struct swaybg_output *output,
+		struct background_image *image) {
+	int width = image->width;
+	int height = image->height;
+	struct swaybg_buffer *buffer = get_shared_buffer(output->state,
+			output->config, image, width, height);
+	if (!buffer) {
+		return false;
+	}
+	set_output_buffer(output, buffer);
+
+	if (output->config->mode == BACKGROUND_MODE_FILL) {
+		// Crop the image symmetrically to the aspect ratio of the output.
+		// Working in fixed point keeps the source inside the buffer.
+		double window_ratio = (double)output->width / output->height;
+		double bg_ratio = (double)width / height;
+		wl_fixed_t x = 0, y = 0;
+		if (window_ratio > bg_ratio) {
+			y = wl_fixed_from_double((height - width / window_ratio) / 2);
+		} else {
+			x = wl_fixed_from_double((width - height * window_ratio) / 2);
+		}
+		wp_viewport_set_source(output->viewport, x, y,
+				wl_fixed_from_int(width) - 2 * x,
+				wl_fixed_from_int(height) - 2 * y);
+	} else {
+		unset_viewport_source(output->viewport);
+	}
+	wp_viewport_set_destination(output->viewport,
+			output->width, output->height);
+
+	wl_surface_set_buffer_scale(output->surface, 1);
+	attach_buffer(output, &buffer->buffer);
+	wl_surface_damage_buffer(output->surface, 0, 0, INT32_MAX, INT32_MAX);
+	wl_surface_commit(output->surface);
+	return true;
+}
+
+/**
+ * Returns a fade buffer the compositor is not reading from, or NULL if it
+ * still holds both.
+ */
+static struct swaybg_buffer *get_fade_buffer(struct swaybg_output *output) {
+	struct pool_buffer *to = &output->buffer->buffer;
+	for (size_t i = 0; i < 2; ++i) {
+		struct swaybg_buffer *buffer = output->fade_buffers[i];
+		if (!buffer && output->fade_shown && output->fade_from->refs == 1) {
+			// No step reads the frame the fade started from any more, and
+			// nothing else uses it, so it can be written to
+			buffer = output->fade_from;
+			buffer->refs++;
+			buffer->config = NULL;
+			output->fade_buffers[i] = buffer;
+		} else if (!buffer) {
+			// Not matched to any config, so it is never shared
+			buffer = create_shared_buffer(output->state, NULL,
+					to->width, to->height, to->format);
+			output->fade_buffers[i] = buffer;
+			return buffer;
+		}
+		if (!buffer->buffer.busy) {
+			return buffer;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Commits the next step of the fade, or the final frame once the fade is
+ * over. Both frames are already scaled, so each step only blends, in bands
+ * on the thread pool.
+ */
+static void render_fade_frame(struct swaybg_output *output) {
+	struct timespec now;
+	get_time(&now);
+	int64_t elapsed = timespec_to_msec(&now) - output->fade_start;
+	int duration = output->state->fade_duration;
+	struct pool_buffer *from = &output->fade_from->buffer;
+	struct pool_buffer *to = &output->buffer->buffer;
+	if (elapsed >= duration) {
+		stop_fade(output);
+		attach_buffer(output, to);
+		wl_surface_damage_buffer(output->surface, 0, 0, INT32_MAX, INT32_MAX);
+		if (output->animation) {
+			request_frame(output);
+		}
+		wl_surface_commit(output->surface);
+		return;
+	}
+
+	struct swaybg_buffer *buffer = get_fade_buffer(output);
+	unsigned target = elapsed > 0 ? elapsed * 256 / duration : 0;
+	unsigned weight = target;
+	if (output->fade_shown) {
+		// Blend on from the last step. Covering the part of the way to
+		// target that it has left ends up where blending from fade_from
+		// would have, give or take rounding.
+		from = &output->fade_shown->buffer;
+		unsigned shown = output->fade_weight;
+		if (target < shown) {
+			target = shown;
+		}
+		weight = ((target - shown) * 256 + (256 - shown) / 2) / (256 - shown);
+	}
+	struct pool_buffer *dst = buffer ? &buffer->buffer : NULL;
+	if (dst && blend_images_banded(dst->data, from->data, to->data,
+				dst->width, dst->height, dst->stride, weight,
+				output->state->thread_pool)) {
+		attach_buffer(output, dst);
+		wl_surface_damage_buffer(output->surface, 0, 0, INT32_MAX, INT32_MAX);
+		output->fade_shown = buffer;
+		output->fade_weight = target;
+	}
+	// Without a free buffer this frame is skipped, but the next one is
+	// still waited for
+	request_frame(output);
+	wl_surface_commit(output->surface);
+}
+
+/**
+ * Frames can only be blended if their pixels line up and have 8 bits per
+ * channel.
+ */
+static bool can_fade(struct swaybg_output *output,
+		struct swaybg_buffer *from, struct swaybg_buffer *to) {
+	return output->state->fade_duration > 0 && from && from != to &&
+		from->buffer.width == to->buffer.width &&
+		from->buffer.height == to->buffer.height &&
+		from->buffer.format == to->buffer.format &&
+		from->buffer.format != WL_SHM_FORMAT_RGB565;
+}
+
+static void commit_scaled_buffer(struct swaybg_output *output,
+		struct swaybg_buffer *buffer) {
+	// Fade from what is on screen, which may be a step of an earlier fade
+	struct swaybg_buffer *from = output->buffer;
+	if (output->fade_from) {
+		from = output->fade_shown ? output->fade_shown : output->fade_from;
+	} else if (output->animation) {
+		from = output->animation->shown;
+	}
+	bool fade = can_fade(output, from, buffer);
+	if (fade) {
+		// Keep the old frame around until the fade is over
+		from->refs++;
+	}
+	set_output_buffer(output, buffer);
+
+	if (output->preferred_scale) {
+		// Fractional scales can only be expressed with a viewport
+		wl_surface_set_buffer_scale(output->surface, 1);
+		unset_viewport_source(output->viewport);
+		wp_viewport_set_destination(output->viewport,
+				output->width, output->height);
+	} else {
+		wl_surface_set_buffer_scale(output->surface, output->scale);
+		if (output->viewport) {
+			unset_viewport_source(output->viewport);
+			wp_viewport_set_destination(output->viewport, -1, -1);
+		}
+	}
+	if (fade) {
+		struct timespec now;
+		get_time(&now);
+		output->fade_from = from;
+		output->fade_start = timespec_to_msec(&now);
+		render_fade_frame(output);
+		return;
+	}
+	attach_buffer(output, &buffer->buffer);
+	wl_surface_damage_buffer(output->surface, 0, 0, INT32_MAX, INT32_MAX);
+	wl_surface_commit(output->surface);
+}
+
+static size_t get_bytes_per_pixel(const struct pool_buffer *buffer) {
+	return buffer->format == WL_SHM_FORMAT_RGB565 ? 2 : 4;
+}
+
+/**
+ * Finds the smallest rectangle outside of which two buffers of the same size
+ * and format are equal. Returns false if they are equal everywhere.
+ */
+static bool get_changed_region(const struct pool_buffer *a,
+		const struct pool_buffer *b, int32_t *x, int32_t *y,
+		int32_t *width, int32_t *height) {
+	size_t bpp = get_bytes_per_pixel(a);
+	size_t row_size = a->width * bpp;
+	const uint8_t *data_a = a->data;
+	const uint8_t *data_b = b->data;
+	uint32_t top = 0, bottom = a->height;
+	while (top < bottom && memcmp(data_a + (size_t)top * a->stride,
+				data_b + (size_t)top * a->stride, row_size) == 0) {
+		top++;
+	}
+	if (top == bottom) {
+		return false;
+	}
+	while (memcmp(data_a + (size_t)(bottom - 1) * a->stride,
+				data_b + (size_t)(bottom - 1) * a->stride, row_size) == 0) {
+		bottom--;
+	}
+
+	uint32_t left = a->width, right = 0;
+	for (uint32_t row = top; row < bottom; ++row) {
+		const uint8_t *row_a = data_a + (size_t)row * a->stride;
+		const uint8_t *row_b = data_b + (size_t)row * a->stride;
+		uint32_t l = 0;
+		while (l < left && memcmp(row_a + l * bpp, row_b + l * bpp, bpp) == 0) {
+			l++;
+		}
+		left = l;
+		uint32_t r = a->width;
+		while (r > right && memcmp(row_a + (r - 1) * bpp,
+					row_b + (r - 1) * bpp, bpp) == 0) {
+			r--;
+		}
+		right = r;
+	}
+	*x = left;
+	*y = top;
+	*width = right - left;
+	*height = bottom - top;
+	return true;
+}
+
+static void schedule_animation_frame(struct swaybg_animation *animation) {
+	int delay = animation->frames[animation->frame].delay;
+	if (delay < 0) {
+		animation->next_frame = INT64_MAX;
+		return;
+	}
+	// Keep to the timing of the animation, unless we fell behind it
+	struct timespec now;
+	get_time(&now);
+	animation->next_frame += delay;
+	if (animation->next_frame < timespec_to_msec(&now)) {
+		animation->next_frame = timespec_to_msec(&now);
+	}
+}
+
+static void scale_animation_slot_task(struct thread_pool_task *task) {
+	struct swaybg_animation_slot *slot = wl_container_of(task, slot, task);
+	struct swaybg_animation *animation = slot->animation;
+	struct pool_buffer *buffer = &slot->buffer->buffer;
+	// The buffer may still hold an earlier frame
+	memset(buffer->data, 0, (size_t)buffer->stride * buffer->height);
+	render_background_image_banded(buffer->surface,
+			animation->frames[slot->frame].surface, animation->mode,
+			animation->color, animation->pool);
+	if (!get_changed_region(slot->base, buffer, &slot->damage_x,
+				&slot->damage_y, &slot->damage_width, &slot->damage_height)) {
+		slot->damage_width = slot->damage_height = 0;
+	}
+}
+
+/**
+ * Starts scaling the frame after the one on screen into its slot, unless
+ * the slot already holds it or the compositor still needs the frame in it.
+ * Returns false if the animation cannot go on.
+ */
+static bool prepare_animation_frame(struct swaybg_output *output) {
+	struct swaybg_animation *animation = output->animation;
+	struct pool_buffer *shown = &animation->shown->buffer;
+	size_t frame = (animation->frame + 1) % animation->num_frames;
+	struct swaybg_animation_slot *slot =
+		&animation->slots[animation_ring_get_slot(&animation->ring, frame)];
+	if (slot->scaling) {
+		return true;
+	}
+	if (!slot->buffer) {
+		slot->buffer = create_shared_buffer(output->state, NULL,
+				shown->width, shown->height, shown->format);
+		if (!slot->buffer) {
+			return false;
+		}
+		slot->frame = SIZE_MAX;
+	}
+	if (slot->frame == frame) {
+		if (slot->damage_base != animation->frame) {
+			if (!get_changed_region(shown, &slot->buffer->buffer,
+						&slot->damage_x, &slot->damage_y,
+						&slot->damage_width, &slot->damage_height)) {
+				slot->damage_width = slot->damage_height = 0;
+			}
+			slot->damage_base = animation->frame;
+		}
+		return true;
+	}
+	if (slot->buffer->buffer.busy) {
+		// The compositor still needs the frame from an earlier loop
+		return true;
+	}
+	slot->frame = frame;
+	slot->damage_base = animation->frame;
+	slot->base = shown;
+	slot->scaling = true;
+	thread_pool_submit(animation->pool, &slot->task,
+			scale_animation_slot_task);
+	return true;
+}
+
+/**
+ * Commits the next frame of the animation, waiting for it to be scaled if
+ * it is not yet. Only the region that differs from the frame on screen is
+ * damaged.
+ */
+static void render_animation_frame(struct swaybg_output *output) {
+	struct swaybg_animation *animation = output->animation;
+	if (!prepare_animation_frame(output)) {
+		animation->next_frame = INT64_MAX;
+		return;
+	}
+	size_t frame = (animation->frame + 1) % animation->num_frames;
+	size_t index = animation_ring_get_slot(&animation->ring, frame);
+	struct swaybg_animation_slot *slot = &animation->slots[index];
+	if (slot->frame != frame) {
+		// Try again once the compositor has moved on
+		request_frame(output);
+		wl_surface_commit(output->surface);
+		return;
+	}
+	if (slot->scaling) {
+		thread_pool_wait(animation->pool, &slot->task);
+		slot->scaling = false;
+	}
+
+	attach_buffer(output, &slot->buffer->buffer);
+	if (slot->damage_width > 0) {
+		wl_surface_damage_buffer(output->surface, slot->damage_x,
+				slot->damage_y, slot->damage_width, slot->damage_height);
+	}
+	request_frame(output);
+	wl_surface_commit(output->surface);
+
+	animation->frame = frame;
+	animation->shown = slot->buffer;
+	animation->ring.shown = index;
+	schedule_animation_frame(animation);
+	if (!prepare_animation_frame(output)) {
+		animation->next_frame = INT64_MAX;
+	}
+}
+
+/**
+ * Plays the frames of the image, the first of which the output has just
+ * committed.
+ */
+static void start_animation(struct swaybg_output *output,
+		struct background_image *image) {
+	struct swaybg_animation *animation =
+		calloc(1, sizeof(struct swaybg_animation));
+	struct background_frame *frames =
+		calloc(image->num_frames, sizeof(struct background_frame));
+	if (!animation || !frames) {
+		swaybg_log(LOG_ERROR, "Failed to allocate animation");
+		free(animation);
+		free(frames);
+		return;
+	}
+	// The image may be decoded again while the animation plays
+	for (size_t i = 0; i < image->num_frames; ++i) {
+		frames[i].surface = cairo_surface_reference(image->frames[i].surface);
+		frames[i].delay = image->frames[i].delay;
+	}
+	animation->frames = frames;
+	animation->num_frames = image->num_frames;
+	animation->shown = output->buffer;
+	animation->mode = output->config->mode;
+	animation->color = output->config->color;
+	animation->pool = output->state->thread_pool;
+	for (size_t i = 0; i < ANIMATION_MAX_SLOTS; ++i) {
+		animation->slots[i].animation = animation;
+	}
+
+	struct pool_buffer *buffer = &output->buffer->buffer;
+	size_t num_slots =
+		ANIMATION_CACHE_SIZE / ((size_t)buffer->stride * buffer->height);
+	if (num_slots > ANIMATION_MAX_SLOTS) {
+		num_slots = ANIMATION_MAX_SLOTS;
+	}
+	animation_ring_init(&animation->ring, animation->num_frames, num_slots);
+
+	struct timespec now;
+	get_time(&now);
+	animation->next_frame = timespec_to_msec(&now);
+	schedule_animation_frame(animation);
+	output->animation = animation;
+	if (!prepare_animation_frame(output)) {
+		animation->next_frame = INT64_MAX;
+	}
+	if (!output->fade_from) {
+		// Otherwise the fade asks for a frame callback once it is over
+		request_frame(output);
+		wl_surface_commit(output->surface);
+	}
+}
+
+static bool render_scaled_frame(struct swaybg_output *output,
+		struct background_image *image, int buffer_width, int buffer_height) {
+	struct swaybg_state *state = output->state;
+	struct swaybg_buffer *buffer = get_shared_buffer(state, output->config,
+			image, buffer_width, buffer_height);
+	if (!buffer) {
+		return false;
+	}
+	// Animations are never cached, so that their image is always decoded
+	if (image && !buffer->cached && image->num_frames <= 1) {
+		store_cached_frame(state, output->config, image, buffer);
+		buffer->cached = true;
+	}
+	commit_scaled_buffer(output, buffer);
+	if (image && image->num_frames > 1) {
+		start_animation(output, image);
+	}
+	return true;
+}
+
+/**
+ * Shows a frame from the disk cache if the image has not been decoded yet.
+ */
+static bool render_cached_frame(struct swaybg_output *output,
+		int buffer_width, int buffer_height) {
+	struct swaybg_output_config *config = output->config;
+	if (config->mode == BACKGROUND_MODE_SOLID_COLOR || !config->image ||
+			(!config->image->loading && config->image->decoded) ||
+			config->image->load_failed || can_scale_on_compositor(output)) {
+		return false;
+	}
+	struct swaybg_buffer *buffer = get_cached_buffer(output->state, config,
+			buffer_width, buffer_height);
+	if (!buffer) {
+		return false;
+	}
+	set_opaque_region(output,
+			buffer->buffer.format != WL_SHM_FORMAT_ARGB8888);
+	commit_scaled_buffer(output, buffer);
+	return true;
+}
+
+static bool content_equal(const struct swaybg_content *a,
+		const struct swaybg_content *b) {
+	return a->config == b->config && a->source == b->source &&
+		a->image == b->image &&
+		a->mode == b->mode && a->color == b->color &&
+		a->width == b->width && a->height == b->height &&
+		a->scale == b->scale;
+}
+
+static uint32_t get_output_scale(struct swaybg_output *output) {
+	return output->preferred_scale ?
+		output->preferred_scale : (uint32_t)output->scale * 120;
+}
+
+static void get_buffer_size(struct swaybg_output *output,
+		int *width, int *height) {
+	// Round half away from zero, as the fractional scale protocol asks
+	uint32_t scale = get_output_scale(output);
+	*width = ((uint64_t)output->width * scale + 60) / 120;
+	*height = ((uint64_t)output->height * scale + 60) / 120;
+}
+
+static void render_frame(struct swaybg_output *output) {
+	uint32_t scale = get_output_scale(output);
+	int buffer_width, buffer_height;
+	get_buffer_size(output, &buffer_width, &buffer_height);
+	struct swaybg_content content = {
+		.config = output->config,
+		.source = output->config->image,
+		.mode = output->config->mode,
+		.color = output->config->color,
+		.width = output->width,
+		.height = output->height,
+		.scale = scale,
+	};
+	if (content_equal(&content, &output->committed)) {
+		swaybg_log(LOG_DEBUG, "Output %s is unchanged, not committing",
+				output->name);
+		return;
+	}
+	if (render_cached_frame(output, buffer_width, buffer_height)) {
+		output->committed = content;
+		return;
+	}
+
+	struct background_image *image = get_config_image(output->state,
+			output->config, buffer_width, buffer_height);
+	content.image = image;
+	if (content_equal(&content, &output->committed)) {
+		swaybg_log(LOG_DEBUG, "Output %s is unchanged, not committing",
+				output->name);
+		return;
+	}
+	set_opaque_region(output, is_frame_opaque(output->config, image));
+
+	bool committed;
+	if (!image && output->viewport) {
+		// A single color does not need a full size buffer; let the compositor
+		// scale a single pixel up to the whole output instead
+		committed = render_solid_color_frame(output);
+	} else if (image && image->num_frames <= 1 &&
+			can_scale_on_compositor(output)) {
+		committed = render_native_size_frame(output, image);
+	} else {
+		committed = render_scaled_frame(output, image,
+				buffer_width, buffer_height);
+	}
+	if (committed) {
+		output->committed = content;
+	}
+}
+
+static struct swaybg_output_config *create_swaybg_output_config(
+		const char *output) {
+	struct swaybg_output_config *config =
+		calloc(1, sizeof(struct swaybg_output_config));
+	config->output = strdup(output);
+	config->mode = BACKGROUND_MODE_INVALID;
+	wl_list_init(&config->link);  // init for safe removal
+	return config;
+}
+
+static void destroy_prefetch(struct swaybg_prefetch *prefetch) {
+	if (!prefetch) {
+		return;
+	}
+	// A prefetch that has not started yet is not worth finishing
+	thread_pool_cancel(prefetch->pool, &prefetch->task);
+	for (size_t i = 0; i < prefetch->num_frames; ++i) {
+		if (prefetch->frames[i].frame) {
+			cairo_surface_destroy(prefetch->frames[i].frame);
+		}
+	}
+	if (prefetch->surface) {
+		cairo_surface_destroy(prefetch->surface);
+	}
+	destroy_background_image(prefetch->decoded);
+	free(prefetch);
 }
 
 static void destroy_swaybg_output_config(struct swaybg_output_config *config) {
@@ -127,15 +1478,86 @@ static void destroy_swaybg_output_config(struct swaybg_output_config *config) {
 		return;
 	}
 	wl_list_remove(&config->link);
+	destroy_prefetch(config->prefetch);
+	free(config->slides);
 	free(config->output);
 	free(config);
 }
 
+static void load_output_image(struct swaybg_output *output) {
+	struct swaybg_output_config *config = output->config;
+	if (!config->image || config->mode == BACKGROUND_MODE_SOLID_COLOR ||
+			output->logical_width <= 0 || output->logical_height <= 0) {
+		return;
+	}
+	// The layer surface will cover the whole output, so its buffer size can
+	// be predicted before it is configured
+	int buffer_width = output->logical_width * output->scale;
+	int buffer_height = output->logical_height * output->scale;
+	if ((config->image->loading || !config->image->decoded) &&
+			!can_scale_on_compositor(output) &&
+			has_cached_frame(output->state, config,
+				buffer_width, buffer_height)) {
+		// The image will only be decoded if the prediction was wrong
+		return;
+	}
+	load_image(output->state, config->image, get_image_scale(output->state,
+				config->image, config->mode, buffer_width, buffer_height));
+}
+
+static void unload_unused_image(struct swaybg_state *state,
+		struct swaybg_image *image) {
+	if (!image || (!image->loading && !image->decoded)) {
+		return;
+	}
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->config && output->config->image == image) {
+			return;
+		}
+	}
+	swaybg_log(LOG_DEBUG, "Unloading image %s", image->path);
+	unload_image(state, image);
+}
+
+static void add_dropped_output(struct swaybg_output *output) {
+	struct swaybg_dropped_output *dropped =
+		calloc(1, sizeof(struct swaybg_dropped_output));
+	if (!dropped) {
+		swaybg_log(LOG_ERROR, "Failed to allocate dropped output");
+		return;
+	}
+	dropped->wl_name = output->wl_name;
+	dropped->name = output->name ? strdup(output->name) : NULL;
+	dropped->identifier =
+		output->identifier ? strdup(output->identifier) : NULL;
+	wl_list_insert(&output->state->dropped_outputs, &dropped->link);
+}
+
+static void destroy_dropped_output(struct swaybg_dropped_output *dropped) {
+	wl_list_remove(&dropped->link);
+	free(dropped->name);
+	free(dropped->identifier);
+	free(dropped);
+}
+
 static void destroy_swaybg_output(struct swaybg_output *output) {
 	if (!output) {
 		return;
 	}
 	wl_list_remove(&output->link);
+	if (output->config) {
+		unload_unused_image(output->state, output->config->image);
+	}
+	if (output->fractional_scale != NULL) {
+		wp_fractional_scale_v1_destroy(output->fractional_scale);
+	}
+	cancel_frame(output);
+	stop_fade(output);
+	stop_animation(output);
+	if (output->viewport != NULL) {
+		wp_viewport_destroy(output->viewport);
+	}
 	if (output->layer_surface != NULL) {
 		zwlr_layer_surface_v1_destroy(output->layer_surface);
 	}
@@ -144,21 +1566,116 @@ static void destroy_swaybg_output(struct swaybg_output *output) {
 	}
 	zxdg_output_v1_destroy(output->xdg_output);
 	wl_output_destroy(output->wl_output);
-	destroy_buffer(&output->buffers[0]);
-	destroy_buffer(&output->buffers[1]);
+	unref_shared_buffer(output->buffer);
 	free(output->name);
 	free(output->identifier);
 	free(output);
 }
 
+/**
+ * Outputs are rendered once all pending events have been dispatched, so that
+ * a burst of configure and scale events only results in a single render.
+ */
+static void set_output_dirty(struct swaybg_output *output) {
+	if (output->dirty) {
+		output->state->skipped_renders++;
+	}
+	output->dirty = true;
+}
+
+/**
+ * Moves a fade or animation on, once the compositor has shown its previous
+ * frame.
+ */
+static void render_next_frame(struct swaybg_output *output) {
+	if (output->fade_from) {
+		render_fade_frame(output);
+		return;
+	}
+	struct timespec now;
+	get_time(&now);
+	if (output->animation &&
+			timespec_to_msec(&now) >= output->animation->next_frame) {
+		render_animation_frame(output);
+	} else if (output->animation &&
+			output->animation->next_frame != INT64_MAX &&
+			!prepare_animation_frame(output)) {
+		// The slot may have been busy when the frame before was shown
+		output->animation->next_frame = INT64_MAX;
+	}
+}
+
+static void render_dirty_outputs(struct swaybg_state *state) {
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->needs_ack) {
+			output->needs_ack = false;
+			zwlr_layer_surface_v1_ack_configure(output->layer_surface,
+					output->configure_serial);
+		}
+		if (output->dirty) {
+			output->dirty = false;
+			swaybg_log(LOG_DEBUG, "Rendering output %s (%u renders skipped "
+					"so far)", output->name, state->skipped_renders);
+			bool had_frame = output->committed.config != NULL;
+			int64_t start = trace_begin();
+			render_frame(output);
+			trace_end(start, "render_frame", output->name);
+			if (!had_frame && output->committed.config) {
+				trace_instant("first frame", output->name);
+			}
+		}
+		if (output->frame_ready) {
+			render_next_frame(output);
+		}
+	}
+}
+
+/**
+ * Whether every output has shown its first frame, which is where startup
+ * tracing ends.
+ */
+static bool is_startup_done(struct swaybg_state *state) {
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (!output->committed.config) {
+			return false;
+		}
+	}
+	return !wl_list_empty(&state->outputs);
+}
+
+static int get_animation_timeout(struct swaybg_state *state) {
+	struct timespec now;
+	get_time(&now);
+	int64_t timeout = -1;
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		// Outputs still waiting for a frame callback wake us up with it
+		if (!output->animation || !output->frame_ready || output->fade_from ||
+				output->animation->next_frame == INT64_MAX) {
+			continue;
+		}
+		int64_t t = output->animation->next_frame - timespec_to_msec(&now);
+		if (t < 0) {
+			t = 0;
+		}
+		if (timeout < 0 || t < timeout) {
+			timeout = t;
+		}
+	}
+	return timeout > INT32_MAX ? INT32_MAX : timeout;
+}
+
 static void layer_surface_configure(void *data,
 		struct zwlr_layer_surface_v1 *surface,
 		uint32_t serial, uint32_t width, uint32_t height) {
 	struct swaybg_output *output = data;
 	output->width = width;
 	output->height = height;
-	zwlr_layer_surface_v1_ack_configure(surface, serial);
-	render_frame(output);
+	output->configure_serial = serial;
+	output->needs_ack = true;
+	set_output_dirty(output);
 }
 
 static void layer_surface_closed(void *data,
@@ -193,11 +1710,24 @@ static void output_scale(void *data, struct wl_output *wl_output,
 		int32_t scale) {
 	struct swaybg_output *output = data;
 	output->scale = scale;
-	if (output->state->run_display && output->width > 0 && output->height > 0) {
-		render_frame(output);
+	if (output->width > 0 && output->height > 0) {
+		set_output_dirty(output);
+	}
+}
+
+static void fractional_scale_preferred_scale(void *data,
+		struct wp_fractional_scale_v1 *fractional_scale, uint32_t scale) {
+	struct swaybg_output *output = data;
+	output->preferred_scale = scale;
+	if (output->width > 0 && output->height > 0) {
+		set_output_dirty(output);
 	}
 }
 
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+	.preferred_scale = fractional_scale_preferred_scale,
+};
+
 static const struct wl_output_listener output_listener = {
 	.geometry = output_geometry,
 	.mode = output_mode,
@@ -212,7 +1742,9 @@ static void xdg_output_handle_logical_position(void *data,
 
 static void xdg_output_handle_logical_size(void *data,
 		struct zxdg_output_v1 *xdg_output, int32_t width, int32_t height) {
-	// Who cares
+	struct swaybg_output *output = data;
+	output->logical_width = width;
+	output->logical_height = height;
 }
 
 static void find_config(struct swaybg_output *output, const char *name) {
@@ -271,6 +1803,18 @@ static void create_layer_surface(struct swaybg_output *output) {
 	wl_surface_set_input_region(output->surface, input_region);
 	wl_region_destroy(input_region);
 
+	if (output->state->viewporter) {
+		output->viewport = wp_viewporter_get_viewport(
+				output->state->viewporter, output->surface);
+		if (output->state->fractional_scale_manager) {
+			output->fractional_scale =
+				wp_fractional_scale_manager_v1_get_fractional_scale(
+					output->state->fractional_scale_manager, output->surface);
+			wp_fractional_scale_v1_add_listener(output->fractional_scale,
+					&fractional_scale_listener, output);
+		}
+	}
+
 	output->layer_surface = zwlr_layer_shell_v1_get_layer_surface(
 			output->state->layer_shell, output->surface, output->wl_output,
 			ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND, "wallpaper");
@@ -286,19 +1830,23 @@ static void create_layer_surface(struct swaybg_output *output) {
 	zwlr_layer_surface_v1_add_listener(output->layer_surface,
 			&layer_surface_listener, output);
 	wl_surface_commit(output->surface);
+	trace_instant("layer surface commit", output->name);
 }
 
 static void xdg_output_handle_done(void *data,
 		struct zxdg_output_v1 *xdg_output) {
 	struct swaybg_output *output = data;
+	trace_instant("xdg_output done", output->name);
 	if (!output->config) {
 		swaybg_log(LOG_DEBUG, "Could not find config for output %s (%s)",
 				output->name, output->identifier);
+		add_dropped_output(output);
 		destroy_swaybg_output(output);
 	} else if (!output->layer_surface) {
 		swaybg_log(LOG_DEBUG, "Found config %s for output %s (%s)",
 				output->config->output, output->name, output->identifier);
 		create_layer_surface(output);
+		load_output_image(output);
 	}
 }
 
@@ -310,6 +1858,17 @@ static const struct zxdg_output_v1_listener xdg_output_listener = {
 	.done = xdg_output_handle_done,
 };
 
+static void shm_format(void *data, struct wl_shm *shm, uint32_t format) {
+	struct swaybg_state *state = data;
+	if (format == WL_SHM_FORMAT_RGB565) {
+		state->shm_has_rgb565 = true;
+	}
+}
+
+static const struct wl_shm_listener shm_listener = {
+	.format = shm_format,
+};
+
 static void handle_global(void *data, struct wl_registry *registry,
 		uint32_t name, const char *interface, uint32_t version) {
 	struct swaybg_state *state = data;
@@ -318,6 +1877,7 @@ static void handle_global(void *data, struct wl_registry *registry,
 			wl_registry_bind(registry, name, &wl_compositor_interface, 4);
 	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
 		state->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+		wl_shm_add_listener(state->shm, &shm_listener, state);
 	} else if (strcmp(interface, wl_output_interface.name) == 0) {
 		struct swaybg_output *output = calloc(1, sizeof(struct swaybg_output));
 		output->state = state;
@@ -339,6 +1899,17 @@ static void handle_global(void *data, struct wl_registry *registry,
 	} else if (strcmp(interface, zxdg_output_manager_v1_interface.name) == 0) {
 		state->xdg_output_manager = wl_registry_bind(registry, name,
 			&zxdg_output_manager_v1_interface, 2);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		state->viewporter = wl_registry_bind(registry, name,
+			&wp_viewporter_interface, 1);
+	} else if (strcmp(interface,
+			wp_single_pixel_buffer_manager_v1_interface.name) == 0) {
+		state->single_pixel_buffer_manager = wl_registry_bind(registry, name,
+			&wp_single_pixel_buffer_manager_v1_interface, 1);
+	} else if (strcmp(interface,
+			wp_fractional_scale_manager_v1_interface.name) == 0) {
+		state->fractional_scale_manager = wl_registry_bind(registry, name,
+			&wp_fractional_scale_manager_v1_interface, 1);
 	}
 }
 
@@ -354,6 +1925,14 @@ static void handle_global_remove(void *data, struct wl_registry *registry,
 			break;
 		}
 	}
+	struct swaybg_dropped_output *dropped, *tmp_dropped;
+	wl_list_for_each_safe(dropped, tmp_dropped, &state->dropped_outputs,
+			link) {
+		if (dropped->wl_name == name) {
+			destroy_dropped_output(dropped);
+			break;
+		}
+	}
 }
 
 static const struct wl_registry_listener registry_listener = {
@@ -368,9 +1947,15 @@ static bool store_swaybg_output_config(struct swaybg_state *state,
 		if (strcmp(config->output, oc->output) == 0) {
 			// Merge on top
 			if (config->image) {
-				free(oc->image);
 				oc->image = config->image;
-				config->image = NULL;
+				free(oc->slides);
+				oc->slides = config->slides;
+				oc->num_slides = config->num_slides;
+				config->slides = NULL;
+				config->num_slides = 0;
+			}
+			if (config->interval) {
+				oc->interval = config->interval;
 			}
 			if (config->color) {
 				oc->color = config->color;
@@ -386,14 +1971,628 @@ static bool store_swaybg_output_config(struct swaybg_state *state,
 	return true;
 }
 
+static struct swaybg_image *get_image(struct swaybg_state *state,
+		const char *path) {
+	struct swaybg_image *image;
+	wl_list_for_each(image, &state->images, link) {
+		if (strcmp(image->path, path) == 0) {
+			return image;
+		}
+	}
+	image = calloc(1, sizeof(struct swaybg_image));
+	image->path = strdup(path);
+	wl_list_insert(&state->images, &image->link);
+	file_watcher_add(&state->file_watcher, path);
+	return image;
+}
+
+static void destroy_swaybg_image(struct swaybg_state *state,
+		struct swaybg_image *image) {
+	wait_for_probe(state, image);
+	unload_image(state, image);
+	file_watcher_remove(&state->file_watcher, image->path);
+	wl_list_remove(&image->link);
+	free(image->path);
+	free(image);
+}
+
+static int parse_interval(const char *str) {
+	char *end;
+	long interval = strtol(str, &end, 10);
+	if (*str == '\0' || *end != '\0' || interval <= 0 || interval > INT32_MAX) {
+		return -1;
+	}
+	return interval;
+}
+
+static bool add_config_slide(struct swaybg_output_config *config,
+		struct swaybg_image *image) {
+	struct swaybg_image **slides = realloc(config->slides,
+			(config->num_slides + 1) * sizeof(struct swaybg_image *));
+	if (!slides) {
+		swaybg_log(LOG_ERROR, "Failed to allocate slides");
+		return false;
+	}
+	config->slides = slides;
+	config->slides[config->num_slides++] = image;
+	return true;
+}
+
+static int compare_paths(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Adds all images in a directory to the config, in alphabetical order.
+ */
+static bool add_config_directory(struct swaybg_state *state,
+		struct swaybg_output_config *config, const char *path, DIR *dir) {
+	char **paths = NULL;
+	size_t num_paths = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		size_t size = strlen(path) + 1 + strlen(ent->d_name) + 1;
+		char *file = malloc(size);
+		char **new_paths = realloc(paths, (num_paths + 1) * sizeof(char *));
+		if (!file || !new_paths) {
+			swaybg_log(LOG_ERROR, "Failed to allocate image path");
+			free(file);
+			free(new_paths ? new_paths : paths);
+			paths = NULL;
+			num_paths = 0;
+			break;
+		}
+		paths = new_paths;
+		snprintf(file, size, "%s/%s", path, ent->d_name);
+		struct stat st;
+		// Skip anything that is not an image swaybg can load. The files
+		// themselves are only read once they are shown or prefetched.
+		if (!has_background_image_extension(file) ||
+				stat(file, &st) < 0 || !S_ISREG(st.st_mode)) {
+			free(file);
+			continue;
+		}
+		paths[num_paths++] = file;
+	}
+
+	qsort(paths, num_paths, sizeof(char *), compare_paths);
+	bool found = num_paths > 0;
+	for (size_t i = 0; i < num_paths; ++i) {
+		struct swaybg_image *image = get_image(state, paths[i]);
+		if (i == 0) {
+			config->image = image;
+		}
+		add_config_slide(config, image);
+		free(paths[i]);
+	}
+	free(paths);
+	if (!found) {
+		swaybg_log(LOG_ERROR, "No images found in %s", path);
+	}
+	return found;
+}
+
+/**
+ * Adds an image, or every image in a directory, to the config. The config
+ * shows the first of them, unless it has an interval and more than one image
+ * in total, which makes it a slideshow.
+ */
+static bool add_config_images(struct swaybg_state *state,
+		struct swaybg_output_config *config, const char *path) {
+	DIR *dir = opendir(path);
+	if (dir) {
+		bool found = add_config_directory(state, config, path, dir);
+		closedir(dir);
+		return found;
+	}
+	config->image = get_image(state, path);
+	add_config_slide(config, config->image);
+	return true;
+}
+
+/**
+ * Starts or stops the slideshow of a config after its images or interval
+ * have been set.
+ */
+static void finish_config_slides(struct swaybg_state *state,
+		struct swaybg_output_config *config) {
+	if (config->interval <= 0 || config->num_slides < 2 ||
+			config->mode == BACKGROUND_MODE_SOLID_COLOR) {
+		free(config->slides);
+		config->slides = NULL;
+		config->num_slides = config->slide = 0;
+		destroy_prefetch(config->prefetch);
+		config->prefetch = NULL;
+		return;
+	}
+	if (config->slide < config->num_slides &&
+			config->slides[config->slide] == config->image &&
+			config->next_slide.tv_sec != 0) {
+		// Still showing the same slideshow
+		return;
+	}
+	config->slide = 0;
+	config->image = config->slides[0];
+	destroy_prefetch(config->prefetch);
+	config->prefetch = NULL;
+	get_time(&config->next_slide);
+	config->next_slide.tv_sec += config->interval;
+}
+
+static void prefetch_task(struct thread_pool_task *task) {
+	struct swaybg_prefetch *prefetch = wl_container_of(task, prefetch, task);
+	if (!prefetch->surface) {
+		prefetch->decoded = load_background_image(prefetch->image->path,
+				prefetch->scale);
+		cairo_surface_t *surface = prefetch->decoded ?
+			background_image_get_surface(prefetch->decoded) : NULL;
+		if (!surface) {
+			return;
+		}
+		prefetch->surface = cairo_surface_reference(surface);
+	}
+	if (prefetch->mode == BACKGROUND_MODE_CENTER ||
+			prefetch->mode == BACKGROUND_MODE_TILE) {
+		// These are drawn unscaled, so there are no frames to cache
+		return;
+	}
+	for (size_t i = 0; i < prefetch->num_frames; ++i) {
+		int width = prefetch->frames[i].width;
+		int height = prefetch->frames[i].height;
+		cairo_surface_t *frame =
+			cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+		if (cairo_surface_status(frame) != CAIRO_STATUS_SUCCESS ||
+				!render_background_image_banded(frame, prefetch->surface,
+					prefetch->mode, prefetch->color, prefetch->pool)) {
+			cairo_surface_destroy(frame);
+			continue;
+		}
+		prefetch->frames[i].frame = frame;
+	}
+}
+
+static void prefetch_next_slide(struct swaybg_state *state,
+		struct swaybg_output_config *config) {
+	struct swaybg_image *next =
+		config->slides[(config->slide + 1) % config->num_slides];
+	if (next->load_failed) {
+		return;
+	}
+	struct swaybg_prefetch *prefetch = calloc(1, sizeof(struct swaybg_prefetch));
+	if (!prefetch) {
+		swaybg_log(LOG_ERROR, "Failed to allocate prefetch");
+		return;
+	}
+	prefetch->pool = state->thread_pool;
+	prefetch->image = next;
+	prefetch->mode = config->mode;
+	prefetch->color = config->color;
+
+	// Collect the sizes the outputs showing this config will need
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->config != config || output->width == 0 ||
+				output->height == 0) {
+			continue;
+		}
+		if (can_scale_on_compositor(output)) {
+			prefetch->scale = 1.0;
+			continue;
+		}
+		int width, height;
+		get_buffer_size(output, &width, &height);
+		double scale = get_image_scale(state, next, config->mode,
+				width, height);
+		if (scale > prefetch->scale) {
+			prefetch->scale = scale;
+		}
+		bool known = false;
+		for (size_t i = 0; i < prefetch->num_frames; ++i) {
+			known |= prefetch->frames[i].width == width &&
+				prefetch->frames[i].height == height;
+		}
+		if (!known && prefetch->num_frames < PREFETCH_MAX_FRAMES) {
+			prefetch->frames[prefetch->num_frames].width = width;
+			prefetch->frames[prefetch->num_frames].height = height;
+			prefetch->num_frames++;
+		}
+	}
+	if (prefetch->scale == 0) {
+		// No output is showing this config yet
+		free(prefetch);
+		return;
+	}
+	if (!next->loading && next->decoded && next->scale >= prefetch->scale) {
+		// Converting the image is not thread safe, so do it up front. The
+		// image may be unloaded while the task uses its surface.
+		cairo_surface_t *surface = background_image_get_surface(next->decoded);
+		if (surface) {
+			prefetch->surface = cairo_surface_reference(surface);
+		}
+	}
+
+	swaybg_log(LOG_DEBUG, "Prefetching slide %s", next->path);
+	config->prefetch = prefetch;
+	thread_pool_submit(state->thread_pool, &prefetch->task, prefetch_task);
+}
+
+static void prefetch_slides(struct swaybg_state *state) {
+	struct swaybg_output_config *config;
+	wl_list_for_each(config, &state->configs, link) {
+		if (config->num_slides > 0 && !config->prefetch) {
+			prefetch_next_slide(state, config);
+		}
+	}
+}
+
+static void show_next_slide(struct swaybg_state *state,
+		struct swaybg_output_config *config) {
+	struct swaybg_image *old = config->image;
+	config->slide = (config->slide + 1) % config->num_slides;
+	struct swaybg_image *next = config->slides[config->slide];
+	swaybg_log(LOG_DEBUG, "Showing slide %s", next->path);
+
+	struct swaybg_prefetch *prefetch = config->prefetch;
+	config->prefetch = NULL;
+	if (prefetch && prefetch->image == next) {
+		thread_pool_wait(state->thread_pool, &prefetch->task);
+		if (prefetch->decoded && !next->loading &&
+				(!next->decoded || next->scale < prefetch->scale)) {
+			unload_image(state, next);
+			next->decoded = prefetch->decoded;
+			next->scale = prefetch->scale;
+			prefetch->decoded = NULL;
+		}
+		if (!next->loading && next->decoded &&
+				next->decoded->surface == prefetch->surface) {
+			// Switching to the slide now only takes a copy of these
+			for (size_t i = 0; i < prefetch->num_frames; ++i) {
+				if (!prefetch->frames[i].frame) {
+					continue;
+				}
+				frame_cache_insert(&state->frame_cache, prefetch->surface,
+						prefetch->mode, prefetch->color,
+						prefetch->frames[i].width, prefetch->frames[i].height,
+						prefetch->frames[i].frame);
+				prefetch->frames[i].frame = NULL;
+			}
+		}
+	}
+	destroy_prefetch(prefetch);
+
+	config->image = next;
+	invalidate_config_buffers(state, config);
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->config == config && output->width > 0 &&
+				output->height > 0) {
+			set_output_dirty(output);
+		}
+	}
+	unload_unused_image(state, old);
+}
+
+static void advance_slideshows(struct swaybg_state *state) {
+	struct timespec now;
+	get_time(&now);
+	struct swaybg_output_config *config;
+	wl_list_for_each(config, &state->configs, link) {
+		if (config->num_slides == 0 ||
+				timespec_to_msec(&now) < timespec_to_msec(&config->next_slide)) {
+			continue;
+		}
+		show_next_slide(state, config);
+		config->next_slide.tv_sec += config->interval;
+		if (timespec_to_msec(&config->next_slide) < timespec_to_msec(&now)) {
+			// We fell behind, for example because the system was suspended
+			config->next_slide = now;
+			config->next_slide.tv_sec += config->interval;
+		}
+	}
+}
+
+/**
+ * Returns the number of milliseconds until the next slide is due, or -1 if
+ * there are no slideshows.
+ */
+static int get_slideshow_timeout(struct swaybg_state *state) {
+	struct timespec now;
+	get_time(&now);
+	int64_t timeout = -1;
+	struct swaybg_output_config *config;
+	wl_list_for_each(config, &state->configs, link) {
+		if (config->num_slides == 0) {
+			continue;
+		}
+		int64_t t = timespec_to_msec(&config->next_slide) -
+			timespec_to_msec(&now);
+		if (t < 0) {
+			t = 0;
+		}
+		if (timeout < 0 || t < timeout) {
+			timeout = t;
+		}
+	}
+	return timeout > INT32_MAX ? INT32_MAX : timeout;
+}
+
+/**
+ * Splits a command into words in place. Words are separated by whitespace,
+ * which can be kept in a word by quoting it or escaping it with a backslash.
+ */
+static int split_command(char *line, char **argv, int max_args) {
+	int argc = 0;
+	char *src = line, *dst = line;
+	while (*src) {
+		while (isspace((unsigned char)*src)) {
+			src++;
+		}
+		if (!*src) {
+			break;
+		}
+		if (argc == max_args) {
+			return -1;
+		}
+		argv[argc++] = dst;
+		char quote = 0;
+		while (*src && (quote || !isspace((unsigned char)*src))) {
+			if (*src == quote) {
+				quote = 0;
+			} else if (!quote && (*src == '"' || *src == '\'')) {
+				quote = *src;
+			} else if (*src == '\\' && src[1] && quote != '\'') {
+				*dst++ = *++src;
+			} else {
+				*dst++ = *src;
+			}
+			src++;
+		}
+		if (quote) {
+			return -1;
+		}
+		// The terminator may overwrite the separator that ended the word
+		if (*src) {
+			src++;
+		}
+		*dst++ = '\0';
+	}
+	return argc;
+}
+
+static const char *parse_control_command(struct swaybg_state *state,
+		int argc, char **argv, struct wl_list *configs) {
+	struct swaybg_output_config *config = create_swaybg_output_config("*");
+	wl_list_insert(configs->prev, &config->link);
+	for (int i = 0; i < argc; i += 2) {
+		if (i + 1 >= argc) {
+			return "missing argument";
+		}
+		const char *opt = argv[i], *arg = argv[i + 1];
+		if (strcmp(opt, "-o") == 0 || strcmp(opt, "--output") == 0) {
+			config = create_swaybg_output_config(arg);
+			wl_list_insert(configs->prev, &config->link);
+		} else if (strcmp(opt, "-i") == 0 || strcmp(opt, "--image") == 0) {
+			if (!add_config_images(state, config, arg)) {
+				return "no images found";
+			}
+		} else if (strcmp(opt, "-t") == 0 || strcmp(opt, "--interval") == 0) {
+			config->interval = parse_interval(arg);
+			if (config->interval <= 0) {
+				return "invalid interval";
+			}
+		} else if (strcmp(opt, "-m") == 0 || strcmp(opt, "--mode") == 0) {
+			config->mode = parse_background_mode(arg);
+			if (config->mode == BACKGROUND_MODE_INVALID) {
+				return "invalid mode";
+			}
+		} else if (strcmp(opt, "-c") == 0 || strcmp(opt, "--color") == 0) {
+			if (!is_valid_color(arg)) {
+				return "invalid color";
+			}
+			config->color = parse_color(arg);
+		} else {
+			return "unknown option";
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Merges the configs of a command into the existing ones, and returns whether
+ * anything changed. Configs that were changed lose their shared buffers.
+ */
+static bool apply_control_configs(struct swaybg_state *state,
+		struct wl_list *configs) {
+	bool changed = false;
+	struct swaybg_output_config *config, *tmp;
+	wl_list_for_each_safe(config, tmp, configs, link) {
+		wl_list_remove(&config->link);
+		wl_list_init(&config->link);
+		if (!config->image && !config->color &&
+				config->mode == BACKGROUND_MODE_INVALID) {
+			destroy_swaybg_output_config(config);
+			continue;
+		}
+
+		struct swaybg_output_config *oc, *target = NULL;
+		wl_list_for_each(oc, &state->configs, link) {
+			if (strcmp(config->output, oc->output) == 0) {
+				target = oc;
+				break;
+			}
+		}
+		if (target) {
+			if (config->image && config->mode == BACKGROUND_MODE_INVALID &&
+					target->mode == BACKGROUND_MODE_SOLID_COLOR) {
+				// Show the new image rather than just the color
+				config->mode = BACKGROUND_MODE_STRETCH;
+			}
+			store_swaybg_output_config(state, config);
+			destroy_swaybg_output_config(config);
+		} else {
+			if (config->mode == BACKGROUND_MODE_INVALID) {
+				config->mode = config->image ?
+					BACKGROUND_MODE_STRETCH : BACKGROUND_MODE_SOLID_COLOR;
+			}
+			store_swaybg_output_config(state, config);
+			target = config;
+		}
+
+		finish_config_slides(state, target);
+		invalidate_config_buffers(state, target);
+		changed = true;
+	}
+	return changed;
+}
+
+static void update_output_configs(struct swaybg_state *state) {
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (!output->layer_surface) {
+			// Not set up yet; it will pick up the new configs by itself
+			continue;
+		}
+		struct swaybg_output_config *old = output->config;
+		output->config = NULL;
+		if (output->name) {
+			find_config(output, output->name);
+		}
+		if (output->identifier) {
+			find_config(output, output->identifier);
+		}
+		if (!output->config) {
+			output->config = old;
+		}
+		load_output_image(output);
+		if (output->width > 0 && output->height > 0) {
+			// Outputs whose contents did not change will skip the commit
+			set_output_dirty(output);
+		}
+	}
+
+	struct swaybg_image *image;
+	wl_list_for_each(image, &state->images, link) {
+		unload_unused_image(state, image);
+	}
+}
+
+static bool is_image_used(struct swaybg_state *state,
+		struct swaybg_image *image) {
+	struct swaybg_output_config *config;
+	wl_list_for_each(config, &state->configs, link) {
+		if (config->image == image) {
+			return true;
+		}
+		for (size_t i = 0; i < config->num_slides; ++i) {
+			if (config->slides[i] == image) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/**
+ * Frees the images that commands have replaced, which no config shows any
+ * more.
+ */
+static void destroy_unused_images(struct swaybg_state *state) {
+	struct swaybg_image *image, *tmp;
+	wl_list_for_each_safe(image, tmp, &state->images, link) {
+		if (is_image_used(state, image)) {
+			continue;
+		}
+		struct swaybg_output *output;
+		wl_list_for_each(output, &state->outputs, link) {
+			if (output->committed.source == image) {
+				// A new image may well end up at the same address
+				memset(&output->committed, 0, sizeof(output->committed));
+			}
+		}
+		swaybg_log(LOG_DEBUG, "Freeing unused image %s", image->path);
+		destroy_swaybg_image(state, image);
+	}
+}
+
+/**
+ * Fails for configs naming an output that was let go of for lack of a config,
+ * since it would never pick up the new one. Configs for all outputs still
+ * apply to the others, which is noted.
+ */
+static const char *check_dropped_outputs(struct swaybg_state *state,
+		struct wl_list *configs, const char **note) {
+	struct swaybg_output_config *config;
+	wl_list_for_each(config, configs, link) {
+		if (strcmp(config->output, "*") == 0 &&
+				!wl_list_empty(&state->dropped_outputs)) {
+			*note = "not applied to outputs that were not configured "
+				"at startup";
+		}
+		struct swaybg_dropped_output *dropped;
+		wl_list_for_each(dropped, &state->dropped_outputs, link) {
+			if ((dropped->name &&
+						strcmp(config->output, dropped->name) == 0) ||
+					(dropped->identifier &&
+						strcmp(config->output, dropped->identifier) == 0)) {
+				return "output was not configured at startup";
+			}
+		}
+	}
+	return NULL;
+}
+
+static const char *handle_control_command(void *data, char *line,
+		const char **note) {
+	struct swaybg_state *state = data;
+	char *argv[64];
+	int argc = split_command(line, argv, sizeof(argv) / sizeof(argv[0]));
+	if (argc < 0) {
+		return "malformed command";
+	}
+
+	// New images are added to the front of the list
+	struct wl_list *old_images = state->images.next;
+	struct wl_list configs;
+	wl_list_init(&configs);
+	const char *error = parse_control_command(state, argc, argv, &configs);
+	if (!error) {
+		error = check_dropped_outputs(state, &configs, note);
+	}
+	if (error) {
+		struct swaybg_output_config *config, *tmp;
+		wl_list_for_each_safe(config, tmp, &configs, link) {
+			destroy_swaybg_output_config(config);
+		}
+		while (state->images.next != old_images) {
+			struct swaybg_image *image =
+				wl_container_of(state->images.next, image, link);
+			destroy_swaybg_image(state, image);
+		}
+		return error;
+	}
+	if (apply_control_configs(state, &configs)) {
+		update_output_configs(state);
+	}
+	destroy_unused_images(state);
+	return NULL;
+}
+
 static void parse_command_line(int argc, char **argv,
 		struct swaybg_state *state) {
 	static struct option long_options[] = {
 		{"color", required_argument, NULL, 'c'},
+		{"compositor-scaling", no_argument, NULL, 'S'},
+		{"fade", required_argument, NULL, 'f'},
 		{"help", no_argument, NULL, 'h'},
 		{"image", required_argument, NULL, 'i'},
+		{"interval", required_argument, NULL, 't'},
 		{"mode", required_argument, NULL, 'm'},
 		{"output", required_argument, NULL, 'o'},
+		{"rgb565", no_argument, NULL, 'R'},
+		{"socket", required_argument, NULL, 's'},
 		{"version", no_argument, NULL, 'v'},
 		{0, 0, 0, 0}
 	};
@@ -402,24 +2601,31 @@ static void parse_command_line(int argc, char **argv,
 		"Usage: swaybg <options...>\n"
 		"\n"
 		"  -c, --color            Set the background color.\n"
+		"  -S, --compositor-scaling\n"
+		"                         Let the compositor scale stretched and filled\n"
+		"                         images.\n"
+		"  -f, --fade             Crossfade to new images over so many\n"
+		"                         milliseconds.\n"
 		"  -h, --help             Show help message and quit.\n"
-		"  -i, --image            Set the image to display.\n"
+		"  -i, --image            Set the image, or directory of images, to\n"
+		"                         display.\n"
+		"  -t, --interval         Cycle through the images every so many\n"
+		"                         seconds.\n"
 		"  -m, --mode             Set the mode to use for the image.\n"
 		"  -o, --output           Set the output to operate on or * for all.\n"
+		"  -R, --rgb565           Use 16-bit buffers for opaque backgrounds.\n"
+		"  -s, --socket           Accept commands on the given Unix socket.\n"
 		"  -v, --version          Show the version number and quit.\n"
 		"\n"
 		"Background Modes:\n"
 		"  stretch, fit, fill, center, tile, or solid_color\n";
 
-	struct swaybg_output_config *config = calloc(sizeof(struct swaybg_output_config), 1);
-	config->output = strdup("*");
-	config->mode = BACKGROUND_MODE_INVALID;
-	wl_list_init(&config->link); // init for safe removal
+	struct swaybg_output_config *config = create_swaybg_output_config("*");
 
 	int c;
 	while (1) {
 		int option_index = 0;
-		c = getopt_long(argc, argv, "c:hi:m:o:v", long_options, &option_index);
+		c = getopt_long(argc, argv, "c:f:hi:m:o:Rs:St:v", long_options, &option_index);
 		if (c == -1) {
 			break;
 		}
@@ -431,11 +2637,24 @@ static void parse_command_line(int argc, char **argv,
 			}
 			config->color = parse_color(optarg);
 			break;
+		case 'S':  // compositor-scaling
+			state->compositor_scaling = true;
+			break;
+		case 'f':  // fade
+			state->fade_duration = parse_interval(optarg);
+			if (state->fade_duration <= 0) {
+				swaybg_log(LOG_ERROR, "Invalid fade duration: %s", optarg);
+				state->fade_duration = 0;
+			}
+			break;
 		case 'i':  // image
-			free(config->image);
-			config->image = load_background_image(optarg);
-			if (!config->image) {
-				swaybg_log(LOG_ERROR, "Failed to load image: %s", optarg);
+			add_config_images(state, config, optarg);
+			break;
+		case 't':  // interval
+			config->interval = parse_interval(optarg);
+			if (config->interval <= 0) {
+				swaybg_log(LOG_ERROR, "Invalid interval: %s", optarg);
+				config->interval = 0;
 			}
 			break;
 		case 'm':  // mode
@@ -449,10 +2668,14 @@ static void parse_command_line(int argc, char **argv,
 				// Empty config or merged on top of an existing one
 				destroy_swaybg_output_config(config);
 			}
-			config = calloc(sizeof(struct swaybg_output_config), 1);
-			config->output = strdup(optarg);
-			config->mode = BACKGROUND_MODE_INVALID;
-			wl_list_init(&config->link);  // init for safe removal
+			config = create_swaybg_output_config(optarg);
+			break;
+		case 'R':  // rgb565
+			state->rgb565 = true;
+			break;
+		case 's':  // socket
+			free(state->control_path);
+			state->control_path = strdup(optarg);
 			break;
 		case 'v':  // version
 			fprintf(stdout, "swaybg version " SWAYBG_VERSION "\n");
@@ -494,18 +2717,148 @@ static void parse_command_line(int argc, char **argv,
 				: BACKGROUND_MODE_SOLID_COLOR;
 		}
 	}
+	// The config for all outputs is used by every output without one of
+	// its own, so its image is worth reading ahead. Other configs may be for
+	// outputs that never show up, so only the header of their image is read.
+	wl_list_for_each(config, &state->configs, link) {
+		finish_config_slides(state, config);
+		if (strcmp(config->output, "*") == 0) {
+			probe_image(state, config->image, true);
+		}
+	}
+	wl_list_for_each(config, &state->configs, link) {
+		probe_image(state, config->image, false);
+	}
+}
+
+/**
+ * Decodes an image again after its file was rewritten, and redraws the
+ * outputs showing it.
+ */
+static void reload_image(void *data, const char *path) {
+	struct swaybg_state *state = data;
+	struct swaybg_image *image;
+	bool found = false;
+	wl_list_for_each(image, &state->images, link) {
+		if (strcmp(image->path, path) == 0) {
+			found = true;
+			break;
+		}
+	}
+	if (!found) {
+		return;
+	}
+
+	swaybg_log(LOG_DEBUG, "Reloading image %s", image->path);
+	wait_for_probe(state, image);
+	unload_image(state, image);
+	image->size_read = false;
+	image->load_failed = false;
+
+	struct swaybg_output_config *config;
+	wl_list_for_each(config, &state->configs, link) {
+		if (config->prefetch && config->prefetch->image == image) {
+			destroy_prefetch(config->prefetch);
+			config->prefetch = NULL;
+		}
+		if (config->image == image) {
+			invalidate_config_buffers(state, config);
+		}
+	}
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (!output->config || output->config->image != image ||
+				!output->layer_surface) {
+			continue;
+		}
+		// The new image may well be decoded to the same address
+		memset(&output->committed, 0, sizeof(output->committed));
+		load_output_image(output);
+		if (output->width > 0 && output->height > 0) {
+			set_output_dirty(output);
+		}
+	}
+}
+
+/**
+ * Waits for and dispatches Wayland events, control commands and changes to
+ * image files. Returns false once the connection to the compositor is lost.
+ */
+static bool dispatch_events(struct swaybg_state *state, int timeout) {
+	while (wl_display_prepare_read(state->display) != 0) {
+		if (wl_display_dispatch_pending(state->display) < 0) {
+			return false;
+		}
+	}
+	if (wl_display_flush(state->display) < 0 && errno != EAGAIN) {
+		wl_display_cancel_read(state->display);
+		return false;
+	}
+
+	// poll ignores negative fds, so the watcher needs no special casing
+	struct pollfd fds[2 + CONTROL_MAX_POLLFDS];
+	fds[0] = (struct pollfd){
+		.fd = wl_display_get_fd(state->display),
+		.events = POLLIN,
+	};
+	fds[1] = (struct pollfd){
+		.fd = file_watcher_get_fd(&state->file_watcher),
+		.events = POLLIN,
+	};
+	size_t num_control_fds = state->control_path ?
+		control_socket_get_pollfds(&state->control, &fds[2]) : 0;
+	if (poll(fds, 2 + num_control_fds, timeout) < 0) {
+		wl_display_cancel_read(state->display);
+		return errno == EINTR;
+	}
+
+	if (fds[0].revents & POLLIN) {
+		if (wl_display_read_events(state->display) < 0) {
+			return false;
+		}
+	} else {
+		wl_display_cancel_read(state->display);
+	}
+	if (fds[0].revents & (POLLERR | POLLHUP)) {
+		return false;
+	}
+	if (wl_display_dispatch_pending(state->display) < 0) {
+		return false;
+	}
+	if (fds[1].revents & POLLIN) {
+		file_watcher_dispatch(&state->file_watcher);
+	}
+	if (num_control_fds > 0) {
+		control_socket_dispatch(&state->control, &fds[2], num_control_fds);
+	}
+	return true;
 }
 
 int main(int argc, char **argv) {
 	swaybg_log_init(LOG_DEBUG);
+	trace_init();
 
 	struct swaybg_state state = {0};
 	wl_list_init(&state.configs);
+	wl_list_init(&state.images);
 	wl_list_init(&state.outputs);
+	wl_list_init(&state.dropped_outputs);
+	wl_list_init(&state.buffers);
+	wl_list_init(&state.cache_stores);
+	file_watcher_init(&state.file_watcher, reload_image, &state);
+	// Images are probed on the pool while we connect to the compositor
+	state.thread_pool = thread_pool_create(0);
 
+	int64_t start = trace_begin();
 	parse_command_line(argc, argv, &state);
+	trace_end(start, "parse_command_line", NULL);
 
+	disk_cache_init(&state.disk_cache, DISK_CACHE_MAX_SIZE);
+	frame_cache_init(&state.frame_cache, FRAME_CACHE_MAX_ENTRIES);
+
+	start = trace_begin();
 	state.display = wl_display_connect(NULL);
+	trace_end(start, "wl_display_connect", NULL);
 	if (!state.display) {
 		swaybg_log(LOG_ERROR, "Unable to connect to the compositor. "
 				"If your compositor is running, check or set the "
@@ -515,12 +2868,17 @@ int main(int argc, char **argv) {
 
 	struct wl_registry *registry = wl_display_get_registry(state.display);
 	wl_registry_add_listener(registry, &registry_listener, &state);
+	start = trace_begin();
 	wl_display_roundtrip(state.display);
+	trace_end(start, "registry roundtrip", NULL);
 	if (state.compositor == NULL || state.shm == NULL ||
 			state.layer_shell == NULL || state.xdg_output_manager == NULL) {
 		swaybg_log(LOG_ERROR, "Missing a required Wayland interface");
 		return 1;
 	}
+	if (!shm_arena_init(&state.shm_arena, state.shm)) {
+		return 1;
+	}
 
 	struct swaybg_output *output;
 	wl_list_for_each(output, &state.outputs, link) {
@@ -530,20 +2888,64 @@ int main(int argc, char **argv) {
 			&xdg_output_listener, output);
 	}
 
+	if (state.control_path && !control_socket_init(&state.control,
+				state.control_path, handle_control_command, &state)) {
+		return 1;
+	}
+
 	state.run_display = true;
-	while (wl_display_dispatch(state.display) != -1 && state.run_display) {
-		// This space intentionally left blank
+	while (state.run_display) {
+		int timeout = get_slideshow_timeout(&state);
+		int animation_timeout = get_animation_timeout(&state);
+		if (timeout < 0 || (animation_timeout >= 0 &&
+					animation_timeout < timeout)) {
+			timeout = animation_timeout;
+		}
+		if (!dispatch_events(&state, timeout)) {
+			break;
+		}
+		advance_slideshows(&state);
+		render_dirty_outputs(&state);
+		if (trace_is_enabled() && is_startup_done(&state)) {
+			trace_finish();
+		}
+		prefetch_slides(&state);
+		finish_cache_stores(&state, false);
+		release_unused_buffers(&state);
+	}
+	if (state.control_path) {
+		control_socket_finish(&state.control);
+		free(state.control_path);
 	}
 
+	finish_cache_stores(&state, true);
 	struct swaybg_output *tmp_output;
 	wl_list_for_each_safe(output, tmp_output, &state.outputs, link) {
 		destroy_swaybg_output(output);
 	}
+	struct swaybg_dropped_output *dropped, *tmp_dropped;
+	wl_list_for_each_safe(dropped, tmp_dropped, &state.dropped_outputs, link) {
+		destroy_dropped_output(dropped);
+	}
+	struct swaybg_buffer *buffer, *tmp_buffer;
+	wl_list_for_each_safe(buffer, tmp_buffer, &state.buffers, link) {
+		destroy_shared_buffer(buffer);
+	}
+	shm_arena_finish(&state.shm_arena);
 
 	struct swaybg_output_config *config = NULL, *tmp_config = NULL;
 	wl_list_for_each_safe(config, tmp_config, &state.configs, link) {
 		destroy_swaybg_output_config(config);
 	}
+	struct swaybg_image *image, *tmp_image;
+	wl_list_for_each_safe(image, tmp_image, &state.images, link) {
+		destroy_swaybg_image(&state, image);
+	}
+	frame_cache_finish(&state.frame_cache);
+	disk_cache_finish(&state.disk_cache);
+	file_watcher_finish(&state.file_watcher);
+	thread_pool_destroy(state.thread_pool);
+	trace_finish();
 
 	return 0;
 }
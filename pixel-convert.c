@@ -0,0 +1,428 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdint.h>
+#include "log.h"
+#include "pixel-convert.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+#endif
+
+#ifndef HAVE_X86_KERNELS
+#define HAVE_X86_KERNELS 0
+#endif
+#ifndef HAVE_NEON_KERNELS
+#define HAVE_NEON_KERNELS 0
+#endif
+
+void convert_rgb_row_scalar(uint8_t *dst, const uint8_t *src, int width) {
+	const uint8_t *end = src + 3 * width;
+	while (src < end) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		dst[0] = 0xFF;
+		dst[1] = src[0];
+		dst[2] = src[1];
+		dst[3] = src[2];
+#else
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+		dst[3] = 0xFF;
+#endif
+		src += 3;
+		dst += 4;
+	}
+}
+
+/* premul-color = alpha/255 * color/255 * 255 = (alpha*color)/255
+ * (z/255) = z/256 * 256/255     = z/256 (1 + 1/255)
+ *         = z/256 + (z/256)/255 = (z + z/255)/256
+ *         # recurse once
+ *         = (z + (z + z/255)/256)/256
+ *         = (z + z/256 + z/256/255) / 256
+ *         # only use 16bit uint operations, loose some precision,
+ *         # result is floored.
+ *       ->  (z + z>>8)>>8
+ *         # add 0x80/255 = 0.5 to convert floor to round
+ *       =>  (z+0x80 + (z+0x80)>>8 ) >> 8
+ * ------
+ * tested as equal to lround(z/255.0) for uint z in [0..0xfe02]
+ *
+ * Every intermediate value fits in 16 bits, which the vector kernels below
+ * rely on.
+ */
+#define PREMUL_ALPHA(x,a,b,z) \
+	do { z = a * b + 0x80; x = (z + (z >> 8)) >> 8; } while (0)
+
+void premultiply_rgba_row_scalar(uint8_t *dst, const uint8_t *src,
+		int width) {
+	const uint8_t *end = src + 4 * width;
+	unsigned z1, z2, z3;
+	while (src < end) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		PREMUL_ALPHA(dst[1], src[0], src[3], z1);
+		PREMUL_ALPHA(dst[2], src[1], src[3], z2);
+		PREMUL_ALPHA(dst[3], src[2], src[3], z3);
+		dst[0] = src[3];
+#else
+		PREMUL_ALPHA(dst[0], src[2], src[3], z1);
+		PREMUL_ALPHA(dst[1], src[1], src[3], z2);
+		PREMUL_ALPHA(dst[2], src[0], src[3], z3);
+		dst[3] = src[3];
+#endif
+		src += 4;
+		dst += 4;
+	}
+}
+
+#undef PREMUL_ALPHA
+
+/*
+ * Every channel is blended independently, so this works for any format with
+ * 8 bits per channel regardless of byte order. With weights up to 256, the
+ * weighted sum stays below 0x10000, which the vector kernels below rely on.
+ */
+void blend_row_scalar(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+		int width, unsigned weight) {
+	const uint8_t *end = a + 4 * width;
+	unsigned inverse = 256 - weight;
+	while (a < end) {
+		*dst = (*a * inverse + *b * weight + 0x80) >> 8;
+		a++;
+		b++;
+		dst++;
+	}
+}
+
+#if HAVE_X86_KERNELS
+
+/*
+ * RGB to XRGB needs a byte shuffle, which SSE2 does not have. Load four
+ * overlapping 32-bit words starting at each pixel instead, so that every
+ * lane holds R, G, B and a byte of the next pixel, then swap R and B with
+ * shifts and masks.
+ */
+__attribute__((target("sse2")))
+static void convert_rgb_row_sse2(uint8_t *dst, const uint8_t *src,
+		int width) {
+	const __m128i mask_g = _mm_set1_epi32(0x0000FF00);
+	const __m128i mask_rb = _mm_set1_epi32(0x000000FF);
+	const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+	int i = 0;
+	// Each iteration reads 16 bytes for 4 pixels, so keep 2 pixels of slack
+	for (; width - i >= 6; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 3 * i));
+		__m128i p01 = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+		__m128i p23 = _mm_unpacklo_epi32(_mm_srli_si128(v, 6),
+				_mm_srli_si128(v, 9));
+		__m128i p = _mm_unpacklo_epi64(p01, p23);
+		__m128i r = _mm_slli_epi32(_mm_and_si128(p, mask_rb), 16);
+		__m128i g = _mm_and_si128(p, mask_g);
+		__m128i b = _mm_and_si128(_mm_srli_epi32(p, 16), mask_rb);
+		__m128i out = _mm_or_si128(_mm_or_si128(r, g),
+				_mm_or_si128(b, alpha));
+		_mm_storeu_si128((__m128i *)(dst + 4 * i), out);
+	}
+	convert_rgb_row_scalar(dst + 4 * i, src + 3 * i, width - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_rgb_row_avx2(uint8_t *dst, const uint8_t *src,
+		int width) {
+	// Within each 128-bit lane, gather pixels 0-3 of the lane as B, G, R, X
+	const __m256i shuffle = _mm256_setr_epi8(
+			2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+			2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+	const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+	int i = 0;
+	// Each iteration reads 28 bytes for 8 pixels, so keep 2 pixels of slack
+	for (; width - i >= 10; i += 8) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(src + 3 * i));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(src + 3 * i + 12));
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		__m256i out = _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha);
+		_mm256_storeu_si256((__m256i *)(dst + 4 * i), out);
+	}
+	convert_rgb_row_sse2(dst + 4 * i, src + 3 * i, width - i);
+}
+
+/*
+ * Premultiplies pixels that have been widened to 16 bits per channel and
+ * reordered to B, G, R, A. The alpha lanes are garbage afterwards and get
+ * replaced by the caller.
+ */
+__attribute__((target("sse2")))
+static inline __m128i premultiply_epi16_sse2(__m128i bgra) {
+	const __m128i round = _mm_set1_epi16(0x80);
+	__m128i a = _mm_shufflehi_epi16(
+			_mm_shufflelo_epi16(bgra, _MM_SHUFFLE(3, 3, 3, 3)),
+			_MM_SHUFFLE(3, 3, 3, 3));
+	__m128i z = _mm_add_epi16(_mm_mullo_epi16(bgra, a), round);
+	return _mm_srli_epi16(_mm_add_epi16(z, _mm_srli_epi16(z, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void premultiply_rgba_row_sse2(uint8_t *dst, const uint8_t *src,
+		int width) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask_a = _mm_set1_epi32((int)0xFF000000);
+	int i = 0;
+	for (; width - i >= 4; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		// RGBA to BGRA
+		lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo,
+				_MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+		hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi,
+				_MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+		__m128i out = _mm_packus_epi16(premultiply_epi16_sse2(lo),
+				premultiply_epi16_sse2(hi));
+		out = _mm_or_si128(_mm_andnot_si128(mask_a, out),
+				_mm_and_si128(mask_a, v));
+		_mm_storeu_si128((__m128i *)(dst + 4 * i), out);
+	}
+	premultiply_rgba_row_scalar(dst + 4 * i, src + 4 * i, width - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i premultiply_epi16_avx2(__m256i bgra) {
+	const __m256i round = _mm256_set1_epi16(0x80);
+	__m256i a = _mm256_shufflehi_epi16(
+			_mm256_shufflelo_epi16(bgra, _MM_SHUFFLE(3, 3, 3, 3)),
+			_MM_SHUFFLE(3, 3, 3, 3));
+	__m256i z = _mm256_add_epi16(_mm256_mullo_epi16(bgra, a), round);
+	return _mm256_srli_epi16(_mm256_add_epi16(z, _mm256_srli_epi16(z, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static void premultiply_rgba_row_avx2(uint8_t *dst, const uint8_t *src,
+		int width) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i mask_a = _mm256_set1_epi32((int)0xFF000000);
+	int i = 0;
+	for (; width - i >= 8; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + 4 * i));
+		// Unpacking and packing both work within 128-bit lanes, so the
+		// pixel order is preserved
+		__m256i lo = _mm256_unpacklo_epi8(v, zero);
+		__m256i hi = _mm256_unpackhi_epi8(v, zero);
+		lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo,
+				_MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+		hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi,
+				_MM_SHUFFLE(3, 0, 1, 2)), _MM_SHUFFLE(3, 0, 1, 2));
+		__m256i out = _mm256_packus_epi16(premultiply_epi16_avx2(lo),
+				premultiply_epi16_avx2(hi));
+		out = _mm256_or_si256(_mm256_andnot_si256(mask_a, out),
+				_mm256_and_si256(mask_a, v));
+		_mm256_storeu_si256((__m256i *)(dst + 4 * i), out);
+	}
+	premultiply_rgba_row_sse2(dst + 4 * i, src + 4 * i, width - i);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i blend_epi16_sse2(__m128i a, __m128i b,
+		__m128i inverse, __m128i weight) {
+	const __m128i round = _mm_set1_epi16(0x80);
+	__m128i z = _mm_add_epi16(_mm_mullo_epi16(a, inverse),
+			_mm_mullo_epi16(b, weight));
+	return _mm_srli_epi16(_mm_add_epi16(z, round), 8);
+}
+
+__attribute__((target("sse2")))
+static void blend_row_sse2(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+		int width, unsigned weight) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w = _mm_set1_epi16(weight);
+	const __m128i inv = _mm_set1_epi16(256 - weight);
+	int i = 0;
+	for (; width - i >= 4; i += 4) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + 4 * i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + 4 * i));
+		__m128i lo = blend_epi16_sse2(_mm_unpacklo_epi8(va, zero),
+				_mm_unpacklo_epi8(vb, zero), inv, w);
+		__m128i hi = blend_epi16_sse2(_mm_unpackhi_epi8(va, zero),
+				_mm_unpackhi_epi8(vb, zero), inv, w);
+		_mm_storeu_si128((__m128i *)(dst + 4 * i), _mm_packus_epi16(lo, hi));
+	}
+	blend_row_scalar(dst + 4 * i, a + 4 * i, b + 4 * i, width - i, weight);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blend_epi16_avx2(__m256i a, __m256i b,
+		__m256i inverse, __m256i weight) {
+	const __m256i round = _mm256_set1_epi16(0x80);
+	__m256i z = _mm256_add_epi16(_mm256_mullo_epi16(a, inverse),
+			_mm256_mullo_epi16(b, weight));
+	return _mm256_srli_epi16(_mm256_add_epi16(z, round), 8);
+}
+
+__attribute__((target("avx2")))
+static void blend_row_avx2(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+		int width, unsigned weight) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i w = _mm256_set1_epi16(weight);
+	const __m256i inv = _mm256_set1_epi16(256 - weight);
+	int i = 0;
+	for (; width - i >= 8; i += 8) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + 4 * i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + 4 * i));
+		__m256i lo = blend_epi16_avx2(_mm256_unpacklo_epi8(va, zero),
+				_mm256_unpacklo_epi8(vb, zero), inv, w);
+		__m256i hi = blend_epi16_avx2(_mm256_unpackhi_epi8(va, zero),
+				_mm256_unpackhi_epi8(vb, zero), inv, w);
+		_mm256_storeu_si256((__m256i *)(dst + 4 * i),
+				_mm256_packus_epi16(lo, hi));
+	}
+	blend_row_sse2(dst + 4 * i, a + 4 * i, b + 4 * i, width - i, weight);
+}
+
+#endif // HAVE_X86_KERNELS
+
+#if HAVE_NEON_KERNELS
+
+static void convert_rgb_row_neon(uint8_t *dst, const uint8_t *src,
+		int width) {
+	int i = 0;
+	for (; width - i >= 16; i += 16) {
+		uint8x16x3_t rgb = vld3q_u8(src + 3 * i);
+		uint8x16x4_t bgrx = {{ rgb.val[2], rgb.val[1], rgb.val[0],
+			vdupq_n_u8(0xFF) }};
+		vst4q_u8(dst + 4 * i, bgrx);
+	}
+	convert_rgb_row_scalar(dst + 4 * i, src + 3 * i, width - i);
+}
+
+static inline uint8x8_t premultiply_u8_neon(uint8x8_t c, uint8x8_t a) {
+	uint16x8_t z = vaddq_u16(vmull_u8(c, a), vdupq_n_u16(0x80));
+	return vshrn_n_u16(vsraq_n_u16(z, z, 8), 8);
+}
+
+static inline uint8x16_t premultiply_u8x16_neon(uint8x16_t c, uint8x16_t a) {
+	return vcombine_u8(
+			premultiply_u8_neon(vget_low_u8(c), vget_low_u8(a)),
+			premultiply_u8_neon(vget_high_u8(c), vget_high_u8(a)));
+}
+
+static void premultiply_rgba_row_neon(uint8_t *dst, const uint8_t *src,
+		int width) {
+	int i = 0;
+	for (; width - i >= 16; i += 16) {
+		uint8x16x4_t rgba = vld4q_u8(src + 4 * i);
+		uint8x16_t a = rgba.val[3];
+		uint8x16x4_t bgra = {{
+			premultiply_u8x16_neon(rgba.val[2], a),
+			premultiply_u8x16_neon(rgba.val[1], a),
+			premultiply_u8x16_neon(rgba.val[0], a),
+			a,
+		}};
+		vst4q_u8(dst + 4 * i, bgra);
+	}
+	premultiply_rgba_row_scalar(dst + 4 * i, src + 4 * i, width - i);
+}
+
+static inline uint8x8_t blend_u8_neon(uint8x8_t a, uint8x8_t b,
+		uint16x8_t inverse, uint16x8_t weight) {
+	uint16x8_t z = vmlaq_u16(vmulq_u16(vmovl_u8(a), inverse),
+			vmovl_u8(b), weight);
+	return vshrn_n_u16(vaddq_u16(z, vdupq_n_u16(0x80)), 8);
+}
+
+static void blend_row_neon(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+		int width, unsigned weight) {
+	const uint16x8_t w = vdupq_n_u16(weight);
+	const uint16x8_t inv = vdupq_n_u16(256 - weight);
+	int i = 0;
+	for (; width - i >= 4; i += 4) {
+		uint8x16_t va = vld1q_u8(a + 4 * i);
+		uint8x16_t vb = vld1q_u8(b + 4 * i);
+		uint8x16_t out = vcombine_u8(
+				blend_u8_neon(vget_low_u8(va), vget_low_u8(vb), inv, w),
+				blend_u8_neon(vget_high_u8(va), vget_high_u8(vb), inv, w));
+		vst1q_u8(dst + 4 * i, out);
+	}
+	blend_row_scalar(dst + 4 * i, a + 4 * i, b + 4 * i, width - i, weight);
+}
+
+#endif // HAVE_NEON_KERNELS
+
+static const struct pixel_kernels scalar_kernels = {
+	.name = "scalar",
+	.convert_rgb_row = convert_rgb_row_scalar,
+	.premultiply_rgba_row = premultiply_rgba_row_scalar,
+	.blend_row = blend_row_scalar,
+};
+
+#if HAVE_X86_KERNELS
+static const struct pixel_kernels avx2_kernels = {
+	.name = "AVX2",
+	.convert_rgb_row = convert_rgb_row_avx2,
+	.premultiply_rgba_row = premultiply_rgba_row_avx2,
+	.blend_row = blend_row_avx2,
+};
+
+static const struct pixel_kernels sse2_kernels = {
+	.name = "SSE2",
+	.convert_rgb_row = convert_rgb_row_sse2,
+	.premultiply_rgba_row = premultiply_rgba_row_sse2,
+	.blend_row = blend_row_sse2,
+};
+#elif HAVE_NEON_KERNELS
+static const struct pixel_kernels neon_kernels = {
+	.name = "NEON",
+	.convert_rgb_row = convert_rgb_row_neon,
+	.premultiply_rgba_row = premultiply_rgba_row_neon,
+	.blend_row = blend_row_neon,
+};
+#endif
+
+// The kernels this CPU can run, best first
+static const struct pixel_kernels *supported_kernels[4];
+static size_t num_supported_kernels;
+static pthread_once_t select_kernels_once = PTHREAD_ONCE_INIT;
+
+static void select_kernels(void) {
+#if HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		supported_kernels[num_supported_kernels++] = &avx2_kernels;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		supported_kernels[num_supported_kernels++] = &sse2_kernels;
+	}
+#elif HAVE_NEON_KERNELS
+	// NEON is part of the base AArch64 instruction set
+	supported_kernels[num_supported_kernels++] = &neon_kernels;
+#endif
+	supported_kernels[num_supported_kernels++] = &scalar_kernels;
+	swaybg_log(LOG_DEBUG, "Using %s pixel conversion",
+			supported_kernels[0]->name);
+}
+
+const struct pixel_kernels *const *get_pixel_kernels(size_t *count) {
+	pthread_once(&select_kernels_once, select_kernels);
+	*count = num_supported_kernels;
+	return supported_kernels;
+}
+
+void convert_rgb_row(uint8_t *dst, const uint8_t *src, int width) {
+	pthread_once(&select_kernels_once, select_kernels);
+	supported_kernels[0]->convert_rgb_row(dst, src, width);
+}
+
+void premultiply_rgba_row(uint8_t *dst, const uint8_t *src, int width) {
+	pthread_once(&select_kernels_once, select_kernels);
+	supported_kernels[0]->premultiply_rgba_row(dst, src, width);
+}
+
+void blend_row(uint8_t *dst, const uint8_t *a, const uint8_t *b, int width,
+		unsigned weight) {
+	pthread_once(&select_kernels_once, select_kernels);
+	supported_kernels[0]->blend_row(dst, a, b, width, weight);
+}
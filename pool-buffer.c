@@ -1,15 +1,28 @@
-#define _POSIX_C_SOURCE 200809
+#define _GNU_SOURCE
 #include <assert.h>
 #include <cairo/cairo.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <wayland-client.h>
+#include "config.h"
+#include "log.h"
 #include "pool-buffer.h"
 
+/**
+ * A free range of the arena file. Free extents never overlap or touch; they
+ * are merged as soon as they do.
+ */
+struct shm_extent {
+	size_t offset, size;
+	struct wl_list link;  // struct shm_arena::free
+};
+
 static bool set_cloexec(int fd) {
 	long flags = fcntl(fd, F_GETFD);
 	if (flags == -1) {
@@ -23,7 +36,7 @@ static bool set_cloexec(int fd) {
 	return true;
 }
 
-static int create_pool_file(size_t size, char **name) {
+static int create_pool_file(void) {
 	static const char template[] = "sway-client-XXXXXX";
 	const char *path = getenv("XDG_RUNTIME_DIR");
 	if (path == NULL) {
@@ -32,14 +45,18 @@ static int create_pool_file(size_t size, char **name) {
 	}
 
 	size_t name_size = strlen(template) + 1 + strlen(path) + 1;
-	*name = malloc(name_size);
-	if (*name == NULL) {
+	char *name = malloc(name_size);
+	if (name == NULL) {
 		fprintf(stderr, "allocation failed\n");
 		return -1;
 	}
-	snprintf(*name, name_size, "%s/%s", path, template);
+	snprintf(name, name_size, "%s/%s", path, template);
 
-	int fd = mkstemp(*name);
+	int fd = mkstemp(name);
+	if (fd >= 0) {
+		unlink(name);
+	}
+	free(name);
 	if (fd < 0) {
 		return -1;
 	}
@@ -49,13 +66,214 @@ static int create_pool_file(size_t size, char **name) {
 		return -1;
 	}
 
-	if (ftruncate(fd, size) < 0) {
+	return fd;
+}
+
+#if HAVE_MEMFD_CREATE
+/**
+ * Huge pages are only allocated when they are mapped, so make sure that at
+ * least one is available before committing to them.
+ */
+static bool probe_huge_page(int fd, size_t page_size) {
+	if (ftruncate(fd, page_size) < 0) {
+		return false;
+	}
+	void *data = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	munmap(data, page_size);
+	return true;
+}
+
+static int create_memfd(bool hugetlb) {
+	unsigned int flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+	if (hugetlb) {
+		flags |= MFD_HUGETLB;
+#ifdef MFD_HUGE_2MB
+		flags |= MFD_HUGE_2MB;
+#endif
+	}
+	int fd = memfd_create("swaybg-shm", flags);
+	if (fd < 0) {
+		return -1;
+	}
+	// The file only ever grows, so the compositor does not have to guard
+	// against it shrinking under its mapping
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0) {
 		close(fd);
 		return -1;
 	}
-
 	return fd;
 }
+#endif // HAVE_MEMFD_CREATE
+
+bool shm_arena_init(struct shm_arena *arena, struct wl_shm *shm) {
+	memset(arena, 0, sizeof(struct shm_arena));
+	arena->shm = shm;
+	arena->fd = -1;
+	arena->page_size = sysconf(_SC_PAGESIZE);
+	wl_list_init(&arena->free);
+
+#if HAVE_MEMFD_CREATE
+	const char *hugetlb = getenv("SWAYBG_SHM_HUGETLB");
+	if (hugetlb && strcmp(hugetlb, "1") == 0) {
+		arena->fd = create_memfd(true);
+		struct stat st;
+		// hugetlbfs reports its page size as the block size
+		if (arena->fd >= 0 && fstat(arena->fd, &st) == 0 &&
+				probe_huge_page(arena->fd, st.st_blksize)) {
+			arena->page_size = st.st_blksize;
+		} else {
+			swaybg_log_errno(LOG_INFO, "Failed to create huge page memfd");
+			if (arena->fd >= 0) {
+				close(arena->fd);
+				arena->fd = -1;
+			}
+		}
+	}
+	if (arena->fd < 0) {
+		arena->fd = create_memfd(false);
+	}
+#endif // HAVE_MEMFD_CREATE
+	if (arena->fd < 0) {
+		arena->fd = create_pool_file();
+	}
+	if (arena->fd < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to create shared memory file");
+		return false;
+	}
+	return true;
+}
+
+void shm_arena_finish(struct shm_arena *arena) {
+	struct shm_extent *extent, *tmp;
+	wl_list_for_each_safe(extent, tmp, &arena->free, link) {
+		wl_list_remove(&extent->link);
+		free(extent);
+	}
+	if (arena->pool) {
+		wl_shm_pool_destroy(arena->pool);
+	}
+	if (arena->fd >= 0) {
+		close(arena->fd);
+	}
+	memset(arena, 0, sizeof(struct shm_arena));
+	arena->fd = -1;
+}
+
+/**
+ * Hands the memory of a range back to the system until it is used again,
+ * which also zeroes it. Returns false if that is not possible, in which case
+ * the range keeps its contents.
+ */
+static bool release_pages(struct shm_arena *arena, size_t offset,
+		size_t size) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+	return fallocate(arena->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			offset, size) == 0;
+#else
+	return false;
+#endif
+}
+
+static bool add_free_extent(struct shm_arena *arena, size_t offset,
+		size_t size) {
+	struct shm_extent *prev = NULL, *next;
+	wl_list_for_each(next, &arena->free, link) {
+		if (next->offset > offset) {
+			break;
+		}
+		prev = next;
+	}
+
+	if (prev && prev->offset + prev->size == offset) {
+		prev->size += size;
+		if (&next->link != &arena->free &&
+				prev->offset + prev->size == next->offset) {
+			prev->size += next->size;
+			wl_list_remove(&next->link);
+			free(next);
+		}
+		return true;
+	}
+	if (&next->link != &arena->free && offset + size == next->offset) {
+		next->offset = offset;
+		next->size += size;
+		return true;
+	}
+
+	struct shm_extent *extent = calloc(1, sizeof(struct shm_extent));
+	if (!extent) {
+		swaybg_log(LOG_ERROR, "Failed to allocate shm extent");
+		return false;
+	}
+	extent->offset = offset;
+	extent->size = size;
+	wl_list_insert(prev ? &prev->link : &arena->free, &extent->link);
+	return true;
+}
+
+static bool grow_arena(struct shm_arena *arena, size_t size) {
+	// Double the file so that a series of allocations only needs a
+	// logarithmic number of resizes; unused space is never touched and
+	// costs no memory
+	size_t new_size = arena->size * 2;
+	if (new_size < arena->size + size) {
+		new_size = arena->size + size;
+	}
+	if (new_size > INT32_MAX) {
+		new_size = arena->size + size;
+	}
+	if (new_size > INT32_MAX) {
+		swaybg_log(LOG_ERROR, "Shared memory arena is full");
+		return false;
+	}
+
+	if (ftruncate(arena->fd, new_size) < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to grow shared memory file");
+		return false;
+	}
+	if (!add_free_extent(arena, arena->size, new_size - arena->size)) {
+		return false;
+	}
+	if (arena->pool) {
+		wl_shm_pool_resize(arena->pool, new_size);
+	} else {
+		arena->pool = wl_shm_create_pool(arena->shm, arena->fd, new_size);
+	}
+	arena->size = new_size;
+	return true;
+}
+
+static bool arena_alloc(struct shm_arena *arena, size_t size,
+		size_t *offset) {
+	struct shm_extent *extent, *last = NULL;
+	wl_list_for_each(extent, &arena->free, link) {
+		if (extent->size >= size) {
+			*offset = extent->offset;
+			extent->offset += size;
+			extent->size -= size;
+			if (extent->size == 0) {
+				wl_list_remove(&extent->link);
+				free(extent);
+			}
+			return true;
+		}
+		last = extent;
+	}
+
+	// Only grow by what the free space at the end of the file lacks
+	size_t missing = size;
+	if (last && last->offset + last->size == arena->size) {
+		missing -= last->size;
+	}
+	if (!grow_arena(arena, missing)) {
+		return false;
+	}
+	return arena_alloc(arena, size, offset);
+}
 
 static void buffer_release(void *data, struct wl_buffer *wl_buffer) {
 	struct pool_buffer *buffer = data;
@@ -66,31 +284,52 @@ static const struct wl_buffer_listener buffer_listener = {
 	.release = buffer_release
 };
 
-static struct pool_buffer *create_buffer(struct wl_shm *shm,
+static cairo_format_t get_cairo_format(uint32_t format) {
+	switch (format) {
+	case WL_SHM_FORMAT_XRGB8888:
+		return CAIRO_FORMAT_RGB24;
+	case WL_SHM_FORMAT_RGB565:
+		return CAIRO_FORMAT_RGB16_565;
+	default:
+		assert(format == WL_SHM_FORMAT_ARGB8888);
+		return CAIRO_FORMAT_ARGB32;
+	}
+}
+
+struct pool_buffer *create_buffer(struct shm_arena *arena,
 		struct pool_buffer *buf, int32_t width, int32_t height,
 		uint32_t format) {
-	uint32_t stride = width * 4;
-	size_t size = stride * height;
-
-	char *name;
-	int fd = create_pool_file(size, &name);
-	assert(fd != -1);
-	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-	buf->buffer = wl_shm_pool_create_buffer(pool, 0,
+	cairo_format_t cairo_format = get_cairo_format(format);
+	int stride = cairo_format_stride_for_width(cairo_format, width);
+	size_t size = (size_t)stride * height;
+	// Every buffer gets its own mapping, so slices start on a page boundary
+	size_t slice_size = (size + arena->page_size - 1) &
+		~(arena->page_size - 1);
+
+	size_t offset;
+	if (!arena_alloc(arena, slice_size, &offset)) {
+		return NULL;
+	}
+	void *data = mmap(NULL, slice_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			arena->fd, offset);
+	if (data == MAP_FAILED) {
+		swaybg_log_errno(LOG_ERROR, "Failed to map buffer");
+		add_free_extent(arena, offset, slice_size);
+		return NULL;
+	}
+	buf->buffer = wl_shm_pool_create_buffer(arena->pool, offset,
 			width, height, stride, format);
-	wl_shm_pool_destroy(pool);
-	close(fd);
-	unlink(name);
-	free(name);
-	fd = -1;
 
-	buf->size = size;
+	buf->arena = arena;
+	buf->offset = offset;
+	buf->size = slice_size;
 	buf->width = width;
 	buf->height = height;
+	buf->format = format;
+	buf->stride = stride;
 	buf->data = data;
 	buf->surface = cairo_image_surface_create_for_data(data,
-			CAIRO_FORMAT_ARGB32, width, height, stride);
+			cairo_format, width, height, stride);
 	buf->cairo = cairo_create(buf->surface);
 
 	wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
@@ -108,36 +347,12 @@ void destroy_buffer(struct pool_buffer *buffer) {
 		cairo_surface_destroy(buffer->surface);
 	}
 	if (buffer->data) {
+		// New buffers start out zeroed, like the file when it grows
+		if (!release_pages(buffer->arena, buffer->offset, buffer->size)) {
+			memset(buffer->data, 0, buffer->size);
+		}
 		munmap(buffer->data, buffer->size);
+		add_free_extent(buffer->arena, buffer->offset, buffer->size);
 	}
 	memset(buffer, 0, sizeof(struct pool_buffer));
 }
-
-struct pool_buffer *get_next_buffer(struct wl_shm *shm,
-		struct pool_buffer pool[static 2], uint32_t width, uint32_t height) {
-	struct pool_buffer *buffer = NULL;
-
-	for (size_t i = 0; i < 2; ++i) {
-		if (pool[i].busy) {
-			continue;
-		}
-		buffer = &pool[i];
-	}
-
-	if (!buffer) {
-		return NULL;
-	}
-
-	if (buffer->width != width || buffer->height != height) {
-		destroy_buffer(buffer);
-	}
-
-	if (!buffer->buffer) {
-		if (!create_buffer(shm, buffer, width, height,
-					WL_SHM_FORMAT_ARGB8888)) {
-			return NULL;
-		}
-	}
-	buffer->busy = true;
-	return buffer;
-}
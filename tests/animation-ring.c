@@ -0,0 +1,78 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "animation-ring.h"
+
+/*
+ * Plays animations through a few loops and checks that no frame is scaled
+ * into the slot on screen, and that frames which all fit are kept.
+ */
+
+#define NUM_LOOPS 4
+
+static bool check_ring(size_t num_frames, size_t max_slots,
+		size_t expected_slots) {
+	struct animation_ring ring;
+	animation_ring_init(&ring, num_frames, max_slots);
+	if (ring.num_slots != expected_slots) {
+		fprintf(stderr, "FAIL: %zu frames, %zu slots: got %zu slots, "
+				"expected %zu\n", num_frames, max_slots, ring.num_slots,
+				expected_slots);
+		return false;
+	}
+
+	// The frame each slot holds; the first frame is shown from elsewhere
+	size_t held[64];
+	for (size_t i = 0; i < ring.num_slots; ++i) {
+		held[i] = SIZE_MAX;
+	}
+	size_t renders = 0;
+	for (size_t n = 1; n < NUM_LOOPS * num_frames; ++n) {
+		size_t frame = n % num_frames;
+		size_t slot = animation_ring_get_slot(&ring, frame);
+		if (slot >= ring.num_slots) {
+			fprintf(stderr, "FAIL: %zu frames, %zu slots: frame %zu got "
+					"slot %zu of %zu\n", num_frames, max_slots, frame, slot,
+					ring.num_slots);
+			return false;
+		}
+		if (held[slot] != frame) {
+			if (slot == ring.shown) {
+				fprintf(stderr, "FAIL: %zu frames, %zu slots: frame %zu "
+						"scaled into slot %zu on screen\n", num_frames,
+						max_slots, frame, slot);
+				return false;
+			}
+			held[slot] = frame;
+			renders++;
+		}
+		ring.shown = slot;
+	}
+
+	size_t expected_renders = NUM_LOOPS * num_frames - 1;
+	if (ring.num_slots == num_frames) {
+		expected_renders = num_frames;
+	}
+	if (renders != expected_renders) {
+		fprintf(stderr, "FAIL: %zu frames, %zu slots: %zu frames scaled, "
+				"expected %zu\n", num_frames, max_slots, renders,
+				expected_renders);
+		return false;
+	}
+	return true;
+}
+
+int main(void) {
+	bool ok = true;
+	// Slot frame % 3 would show frame 3 from slot 0, and then scale frame 0
+	// into it while it is still on screen
+	ok &= check_ring(4, 3, 3);
+	ok &= check_ring(16, 15, 3);
+	ok &= check_ring(5, 2, 2);
+	ok &= check_ring(3, 1, 2);
+	ok &= check_ring(2, 0, 2);
+	ok &= check_ring(4, 4, 4);
+	ok &= check_ring(7, 64, 7);
+	ok &= check_ring(64, 64, 64);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,141 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pixel-convert.h"
+
+/*
+ * Checks that every vectorized kernel this CPU can run writes exactly the
+ * same bytes as the scalar version, and nothing past the end of the row.
+ */
+
+// One pixel for every pair of color and alpha values, and enough bytes for
+// every pair of values to blend
+#define NUM_PIXELS 65536
+// Covers every tail length of every kernel: none handles more than 16 pixels
+// per iteration or needs more than 2 pixels of slack
+#define MAX_TAIL_WIDTH 40
+// Bytes after the row that must not be written to
+#define GUARD_SIZE 64
+
+// Where short rows start: aligned, unaligned, and at half and full alpha.
+// -1 ends them at the end of the source, so that reading past it shows up
+// with a sanitizer.
+static const int offsets[] = { 0, 1, 0x8000 + 3, 0xFF00 + 5, -1 };
+
+static uint8_t *expected, *actual;
+
+static void clear_rows(void) {
+	memset(expected, 0xA5, (size_t)NUM_PIXELS * 4 + GUARD_SIZE);
+	memset(actual, 0xA5, (size_t)NUM_PIXELS * 4 + GUARD_SIZE);
+}
+
+static bool rows_equal(const char *kernels, const char *function,
+		int width, int offset) {
+	if (memcmp(expected, actual, (size_t)width * 4 + GUARD_SIZE) != 0) {
+		fprintf(stderr, "FAIL: %s %s, width %d, offset %d\n",
+				kernels, function, width, offset);
+		return false;
+	}
+	return true;
+}
+
+static bool check_convert_rgb_row(const struct pixel_kernels *kernels,
+		const struct pixel_kernels *scalar, const uint8_t *rgb,
+		int width, int offset) {
+	clear_rows();
+	scalar->convert_rgb_row(expected, rgb + offset * 3, width);
+	kernels->convert_rgb_row(actual, rgb + offset * 3, width);
+	return rows_equal(kernels->name, "convert_rgb_row", width, offset);
+}
+
+static bool check_premultiply_rgba_row(const struct pixel_kernels *kernels,
+		const struct pixel_kernels *scalar, const uint8_t *rgba,
+		int width, int offset) {
+	clear_rows();
+	scalar->premultiply_rgba_row(expected, rgba + offset * 4, width);
+	kernels->premultiply_rgba_row(actual, rgba + offset * 4, width);
+	return rows_equal(kernels->name, "premultiply_rgba_row", width, offset);
+}
+
+static bool check_blend_row(const struct pixel_kernels *kernels,
+		const struct pixel_kernels *scalar, const uint8_t *a,
+		const uint8_t *b, int width, int offset, unsigned weight) {
+	clear_rows();
+	scalar->blend_row(expected, a + offset * 4, b + offset * 4, width,
+			weight);
+	kernels->blend_row(actual, a + offset * 4, b + offset * 4, width, weight);
+	if (!rows_equal(kernels->name, "blend_row", width, offset)) {
+		fprintf(stderr, "  with weight %u\n", weight);
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char **argv) {
+	// Pixel i has alpha i / 256, and every color channel takes every value
+	// for each alpha
+	uint8_t *rgb = malloc((size_t)NUM_PIXELS * 3);
+	uint8_t *rgba = malloc((size_t)NUM_PIXELS * 4);
+	// Byte i of the two blended rows is i % 256 and i / 256 % 256
+	uint8_t *blend_a = malloc((size_t)NUM_PIXELS * 4);
+	uint8_t *blend_b = malloc((size_t)NUM_PIXELS * 4);
+	expected = malloc((size_t)NUM_PIXELS * 4 + GUARD_SIZE);
+	actual = malloc((size_t)NUM_PIXELS * 4 + GUARD_SIZE);
+	if (!rgb || !rgba || !blend_a || !blend_b || !expected || !actual) {
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < NUM_PIXELS; ++i) {
+		uint8_t c = i & 0xFF, a = i >> 8;
+		uint8_t pixel[] = { c, 0xFF - c, c ^ 0x5A, a };
+		memcpy(rgb + i * 3, pixel, 3);
+		memcpy(rgba + i * 4, pixel, 4);
+	}
+	for (int i = 0; i < NUM_PIXELS * 4; ++i) {
+		blend_a[i] = i & 0xFF;
+		blend_b[i] = i >> 8 & 0xFF;
+	}
+
+	size_t num_kernels;
+	const struct pixel_kernels *const *kernels = get_pixel_kernels(&num_kernels);
+	const struct pixel_kernels *scalar = kernels[num_kernels - 1];
+	int failures = 0;
+	for (size_t i = 0; i + 1 < num_kernels; ++i) {
+		printf("Testing %s kernels\n", kernels[i]->name);
+		failures += !check_convert_rgb_row(kernels[i], scalar, rgb,
+				NUM_PIXELS, 0);
+		failures += !check_premultiply_rgba_row(kernels[i], scalar, rgba,
+				NUM_PIXELS, 0);
+		for (size_t j = 0; j < sizeof(offsets) / sizeof(offsets[0]); ++j) {
+			for (int width = 0; width <= MAX_TAIL_WIDTH; ++width) {
+				int offset = offsets[j] < 0 ? NUM_PIXELS - width : offsets[j];
+				failures += !check_convert_rgb_row(kernels[i], scalar,
+						rgb, width, offset);
+				failures += !check_premultiply_rgba_row(kernels[i], scalar,
+						rgba, width, offset);
+			}
+		}
+		// Every weight a fade can use, including the final one
+		for (unsigned weight = 0; weight <= 256; ++weight) {
+			failures += !check_blend_row(kernels[i], scalar, blend_a,
+					blend_b, NUM_PIXELS, 0, weight);
+			for (size_t j = 0; j < sizeof(offsets) / sizeof(offsets[0]); ++j) {
+				for (int width = 0; width <= MAX_TAIL_WIDTH; ++width) {
+					int offset =
+						offsets[j] < 0 ? NUM_PIXELS - width : offsets[j];
+					failures += !check_blend_row(kernels[i], scalar,
+							blend_a, blend_b, width, offset, weight);
+				}
+			}
+		}
+	}
+
+	free(rgb);
+	free(rgba);
+	free(blend_a);
+	free(blend_b);
+	free(expected);
+	free(actual);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,151 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "background-image.h"
+#include "cairo.h"
+#include "thread-pool.h"
+
+/*
+ * Checks that rendering a buffer in parallel bands gives exactly the same
+ * pixels as rendering it in one go, for every mode and for buffer heights
+ * that do not split evenly into bands. The banded target starts out with
+ * garbage, which must not show through.
+ */
+
+static const struct {
+	const char *name;
+	enum background_mode mode;
+} modes[] = {
+	{ "stretch", BACKGROUND_MODE_STRETCH },
+	{ "fill", BACKGROUND_MODE_FILL },
+	{ "fit", BACKGROUND_MODE_FIT },
+	{ "center", BACKGROUND_MODE_CENTER },
+	{ "tile", BACKGROUND_MODE_TILE },
+};
+
+static const struct {
+	int width, height;
+} sizes[] = {
+	{ 1, 1 },
+	{ 61, 127 },
+	{ 300, 129 },
+	{ 333, 517 },
+	{ 1366, 768 },
+	{ 97, 1025 },
+};
+
+static const uint32_t colors[] = { 0, 0x336699FF };
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/**
+ * Creates an image of noise, which shows any difference in sampling.
+ */
+static cairo_surface_t *create_image(cairo_format_t format, int width,
+		int height) {
+	cairo_surface_t *image = cairo_image_surface_create(format, width, height);
+	unsigned char *data = cairo_image_surface_get_data(image);
+	int stride = cairo_image_surface_get_stride(image);
+	uint32_t state = 0x12345678;
+	for (int y = 0; y < height; ++y) {
+		uint32_t *row = (uint32_t *)(data + (size_t)y * stride);
+		for (int x = 0; x < width; ++x) {
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			uint32_t a = format == CAIRO_FORMAT_ARGB32 ? state >> 24 : 0xFF;
+			// Keep the channels premultiplied
+			uint32_t r = (state & 0xFF) * a / 0xFF;
+			uint32_t g = (state >> 8 & 0xFF) * a / 0xFF;
+			uint32_t b = (state >> 16 & 0xFF) * a / 0xFF;
+			row[x] = a << 24 | r << 16 | g << 8 | b;
+		}
+	}
+	cairo_surface_mark_dirty(image);
+	return image;
+}
+
+static cairo_surface_t *render_full(cairo_surface_t *image,
+		enum background_mode mode, uint32_t color, int width, int height) {
+	cairo_surface_t *target =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	cairo_t *cairo = cairo_create(target);
+	if (color) {
+		cairo_set_source_u32(cairo, color);
+		cairo_paint(cairo);
+	}
+	render_background_image(cairo, image, mode, width, height);
+	cairo_destroy(cairo);
+	cairo_surface_flush(target);
+	return target;
+}
+
+static bool surfaces_equal(cairo_surface_t *a, cairo_surface_t *b) {
+	int width = cairo_image_surface_get_width(a);
+	int height = cairo_image_surface_get_height(a);
+	int stride_a = cairo_image_surface_get_stride(a);
+	int stride_b = cairo_image_surface_get_stride(b);
+	unsigned char *data_a = cairo_image_surface_get_data(a);
+	unsigned char *data_b = cairo_image_surface_get_data(b);
+	for (int y = 0; y < height; ++y) {
+		if (memcmp(data_a + (size_t)y * stride_a,
+				data_b + (size_t)y * stride_b, (size_t)width * 4) != 0) {
+			fprintf(stderr, "first difference in row %d\n", y);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool check_render(struct thread_pool *pool, cairo_surface_t *image,
+		enum background_mode mode, uint32_t color, int width, int height) {
+	cairo_surface_t *full = render_full(image, mode, color, width, height);
+	cairo_surface_t *banded =
+		cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	cairo_surface_flush(banded);
+	memset(cairo_image_surface_get_data(banded), 0xA5,
+			(size_t)cairo_image_surface_get_stride(banded) * height);
+	cairo_surface_mark_dirty(banded);
+	bool ok = render_background_image_banded(banded, image, mode, color,
+			pool) && surfaces_equal(full, banded);
+	cairo_surface_destroy(banded);
+	cairo_surface_destroy(full);
+	return ok;
+}
+
+int main(int argc, char **argv) {
+	struct thread_pool *pool = thread_pool_create(4);
+	if (!pool) {
+		return EXIT_FAILURE;
+	}
+	cairo_surface_t *images[] = {
+		create_image(CAIRO_FORMAT_RGB24, 61, 37),
+		create_image(CAIRO_FORMAT_ARGB32, 640, 400),
+	};
+
+	int failures = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(images); ++i) {
+		for (size_t m = 0; m < ARRAY_SIZE(modes); ++m) {
+			for (size_t s = 0; s < ARRAY_SIZE(sizes); ++s) {
+				for (size_t c = 0; c < ARRAY_SIZE(colors); ++c) {
+					if (!check_render(pool, images[i], modes[m].mode,
+							colors[c], sizes[s].width, sizes[s].height)) {
+						fprintf(stderr, "FAIL: image %zu, mode %s, %dx%d, "
+								"color %08X\n", i, modes[m].name,
+								sizes[s].width, sizes[s].height, colors[c]);
+						failures++;
+					}
+				}
+			}
+		}
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(images); ++i) {
+		cairo_surface_destroy(images[i]);
+	}
+	thread_pool_destroy(pool);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
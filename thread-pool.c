@@ -0,0 +1,163 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "log.h"
+#include "thread-pool.h"
+
+struct thread_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;  // a task was queued or the pool is stopping
+	pthread_cond_t done_cond;  // a task has finished
+	struct wl_list queue;  // struct thread_pool_task::link, newest first
+	bool stop;
+
+	size_t num_threads;
+	pthread_t threads[];
+};
+
+static void finish_task(struct thread_pool *pool,
+		struct thread_pool_task *task) {
+	pthread_mutex_unlock(&pool->lock);
+	task->run(task);
+	pthread_mutex_lock(&pool->lock);
+	task->state = THREAD_POOL_TASK_DONE;
+	pthread_cond_broadcast(&pool->done_cond);
+}
+
+static void *worker_run(void *data) {
+	struct thread_pool *pool = data;
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (!pool->stop && wl_list_empty(&pool->queue)) {
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		}
+		if (wl_list_empty(&pool->queue)) {
+			break;
+		}
+		struct thread_pool_task *task =
+			wl_container_of(pool->queue.prev, task, link);
+		wl_list_remove(&task->link);
+		task->state = THREAD_POOL_TASK_RUNNING;
+		finish_task(pool, task);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct thread_pool *thread_pool_create(size_t num_threads) {
+	if (num_threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = cpus > 0 ? (size_t)cpus : 1;
+	}
+
+	struct thread_pool *pool = calloc(1,
+			sizeof(struct thread_pool) + num_threads * sizeof(pthread_t));
+	if (!pool) {
+		swaybg_log(LOG_ERROR, "Failed to allocate thread pool");
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	wl_list_init(&pool->queue);
+
+	for (size_t i = 0; i < num_threads; ++i) {
+		if (pthread_create(&pool->threads[i], NULL, worker_run, pool) != 0) {
+			// Carry on with the threads we got; tasks still get done
+			swaybg_log(LOG_ERROR, "Failed to start worker thread");
+			break;
+		}
+		pool->num_threads++;
+	}
+	swaybg_log(LOG_DEBUG, "Started %zu worker threads", pool->num_threads);
+	return pool;
+}
+
+void thread_pool_destroy(struct thread_pool *pool) {
+	if (!pool) {
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (size_t i = 0; i < pool->num_threads; ++i) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+size_t thread_pool_get_num_threads(struct thread_pool *pool) {
+	return pool ? pool->num_threads : 0;
+}
+
+void thread_pool_submit(struct thread_pool *pool,
+		struct thread_pool_task *task,
+		void (*run)(struct thread_pool_task *task)) {
+	task->run = run;
+	if (thread_pool_get_num_threads(pool) == 0) {
+		run(task);
+		task->state = THREAD_POOL_TASK_DONE;
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	task->state = THREAD_POOL_TASK_QUEUED;
+	wl_list_insert(&pool->queue, &task->link);
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_wait(struct thread_pool *pool, struct thread_pool_task *task) {
+	if (thread_pool_get_num_threads(pool) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	if (task->state == THREAD_POOL_TASK_QUEUED) {
+		wl_list_remove(&task->link);
+		task->state = THREAD_POOL_TASK_RUNNING;
+		finish_task(pool, task);
+	}
+	while (task->state != THREAD_POOL_TASK_DONE) {
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+bool thread_pool_cancel(struct thread_pool *pool,
+		struct thread_pool_task *task) {
+	if (thread_pool_get_num_threads(pool) == 0) {
+		return false;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	bool cancelled = task->state == THREAD_POOL_TASK_QUEUED;
+	if (cancelled) {
+		wl_list_remove(&task->link);
+		task->state = THREAD_POOL_TASK_DONE;
+	}
+	while (task->state != THREAD_POOL_TASK_DONE) {
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return cancelled;
+}
+
+bool thread_pool_is_done(struct thread_pool *pool,
+		struct thread_pool_task *task) {
+	if (thread_pool_get_num_threads(pool) == 0) {
+		return true;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	bool done = task->state == THREAD_POOL_TASK_DONE;
+	pthread_mutex_unlock(&pool->lock);
+	return done;
+}
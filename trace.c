@@ -0,0 +1,192 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "trace.h"
+
+struct trace_event {
+	const char *name;
+	char *detail;
+	char phase;  // 'X' for spans, 'i' for instants
+	int tid;
+	int64_t ts, dur;  // In microseconds since trace_init
+};
+
+static struct {
+	bool enabled;
+	char *path;
+	int64_t epoch;
+	pthread_mutex_t mutex;
+	struct trace_event *events;
+	size_t num_events, capacity;
+	int num_threads;
+} trace = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Small numbers read better in trace viewers than thread ids do
+static _Thread_local int thread_index;
+
+static int64_t get_time_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void trace_init(void) {
+	const char *path = getenv("SWAYBG_TRACE");
+	if (!path || !*path) {
+		return;
+	}
+	trace.path = strdup(path);
+	trace.epoch = get_time_us();
+	trace.enabled = trace.path != NULL;
+}
+
+bool trace_is_enabled(void) {
+	pthread_mutex_lock(&trace.mutex);
+	bool enabled = trace.enabled;
+	pthread_mutex_unlock(&trace.mutex);
+	return enabled;
+}
+
+int64_t trace_begin(void) {
+	return get_time_us();
+}
+
+static void add_event(char phase, const char *name, const char *detail,
+		int64_t ts, int64_t dur) {
+	pthread_mutex_lock(&trace.mutex);
+	if (!trace.enabled) {
+		pthread_mutex_unlock(&trace.mutex);
+		return;
+	}
+	if (trace.num_events == trace.capacity) {
+		size_t capacity = trace.capacity ? trace.capacity * 2 : 64;
+		struct trace_event *events =
+			realloc(trace.events, capacity * sizeof(struct trace_event));
+		if (!events) {
+			swaybg_log(LOG_ERROR, "Failed to allocate trace event");
+			pthread_mutex_unlock(&trace.mutex);
+			return;
+		}
+		trace.events = events;
+		trace.capacity = capacity;
+	}
+	if (!thread_index) {
+		thread_index = ++trace.num_threads;
+	}
+	trace.events[trace.num_events++] = (struct trace_event){
+		.name = name,
+		.detail = detail ? strdup(detail) : NULL,
+		.phase = phase,
+		.tid = thread_index,
+		.ts = ts - trace.epoch,
+		.dur = dur,
+	};
+	pthread_mutex_unlock(&trace.mutex);
+}
+
+void trace_end(int64_t start, const char *name, const char *detail) {
+	add_event('X', name, detail, start, get_time_us() - start);
+}
+
+void trace_instant(const char *name, const char *detail) {
+	add_event('i', name, detail, get_time_us(), 0);
+}
+
+static void write_string(FILE *f, const char *str) {
+	fputc('"', f);
+	for (; *str; ++str) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\') {
+			fprintf(f, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf(f, "\\u%04x", c);
+		} else {
+			fputc(c, f);
+		}
+	}
+	fputc('"', f);
+}
+
+static bool write_trace(const char *path) {
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		return false;
+	}
+	int pid = getpid();
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (size_t i = 0; i < trace.num_events; ++i) {
+		struct trace_event *event = &trace.events[i];
+		fprintf(f, "{\"name\":");
+		write_string(f, event->name);
+		fprintf(f, ",\"cat\":\"swaybg\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,"
+				"\"ts\":%lld", event->phase, pid, event->tid,
+				(long long)event->ts);
+		if (event->phase == 'X') {
+			fprintf(f, ",\"dur\":%lld", (long long)event->dur);
+		} else {
+			fprintf(f, ",\"s\":\"t\"");
+		}
+		if (event->detail) {
+			fprintf(f, ",\"args\":{\"detail\":");
+			write_string(f, event->detail);
+			fprintf(f, "}");
+		}
+		fprintf(f, "}%s\n", i + 1 < trace.num_events ? "," : "");
+	}
+	fprintf(f, "]}\n");
+	bool ok = !ferror(f);
+	return fclose(f) == 0 && ok;
+}
+
+void trace_finish(void) {
+	pthread_mutex_lock(&trace.mutex);
+	if (!trace.enabled) {
+		pthread_mutex_unlock(&trace.mutex);
+		return;
+	}
+	trace.enabled = false;
+	pthread_mutex_unlock(&trace.mutex);
+
+	// Nothing is added once tracing is off, so the events are ours now
+	int64_t last_frame = -1;
+	for (size_t i = 0; i < trace.num_events; ++i) {
+		struct trace_event *event = &trace.events[i];
+		if (strcmp(event->name, "first frame") == 0 &&
+				event->ts > last_frame) {
+			last_frame = event->ts;
+		}
+	}
+	for (size_t i = 0; i < trace.num_events; ++i) {
+		struct trace_event *event = &trace.events[i];
+		swaybg_log(LOG_INFO, "Trace: %8.1f ms %8.1f ms  %s %s",
+				event->ts / 1000.0, event->dur / 1000.0, event->name,
+				event->detail ? event->detail : "");
+	}
+	if (last_frame >= 0) {
+		swaybg_log(LOG_INFO, "Time to the first frame of the last output: "
+				"%.1f ms", last_frame / 1000.0);
+	}
+	if (write_trace(trace.path)) {
+		swaybg_log(LOG_INFO, "Wrote %zu trace events to %s",
+				trace.num_events, trace.path);
+	} else {
+		swaybg_log_errno(LOG_ERROR, "Failed to write trace to %s",
+				trace.path);
+	}
+
+	for (size_t i = 0; i < trace.num_events; ++i) {
+		free(trace.events[i].detail);
+	}
+	free(trace.events);
+	trace.events = NULL;
+	trace.num_events = trace.capacity = 0;
+	free(trace.path);
+	trace.path = NULL;
+}